@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,17 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Locking:
+// * Each hash bucket has a spinlock protecting its list and
+//     the refcnt, dev and blockno of the bufs on it, so lookups
+//     of different blocks usually proceed in parallel.
+// * bcache.lock serializes eviction, which is the only code
+//     that holds more than one bucket lock at a time.
+//
+// The number of buffers is set at boot, from the amount of free
+// memory unless NBUF is given at compile time (make NBUF=n), and
+// their headers and data are carved out of kalloc() pages.
 
 
 #include "types.h"
@@ -23,33 +34,142 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#if BSIZE > PGSIZE || PGSIZE % BSIZE != 0
+#error "buffer data is carved out of pages"
+#endif
+
+#define NBUCKET 251
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf head;   // bufs hashing here, through prev/next,
+                     // most recently released first
+};
+
+struct {
+  struct spinlock lock;   // eviction
+  int nbuf;
+  struct bucket bucket[NBUCKET];
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // what is left of the pages newbuf() is carving up.
+  char *hdr;
+  int nhdr;
+  char *data;
+  int ndata;
 } bcache;
 
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+static void
+blink(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+// Allocate a buf header and BSIZE bytes of data for it.
+// Caller holds bcache.lock.
+static struct buf*
+newbuf(void)
+{
+  struct buf *b;
+
+  if(bcache.nhdr == 0){
+    if((bcache.hdr = kalloc()) == 0)
+      panic("newbuf");
+    bcache.nhdr = PGSIZE / sizeof(struct buf);
+  }
+  if(bcache.ndata == 0){
+    if((bcache.data = kalloc()) == 0)
+      panic("newbuf");
+    bcache.ndata = PGSIZE / BSIZE;
+  }
+  b = (struct buf*)bcache.hdr;
+  memset(b, 0, sizeof(*b));
+  b->data = (uchar*)bcache.data;
+  bcache.hdr += sizeof(struct buf);
+  bcache.nhdr--;
+  bcache.data += BSIZE;
+  bcache.ndata--;
+  initsleeplock(&b->lock, "buffer");
+  return b;
+}
+
+// How many bufs the cache has.
+int
+bcachesize(void)
+{
+  return bcache.nbuf;
+}
+
+// Allocate a buf for dev that is not part of the cache,
+// for code like the log that keeps its own copies of
+// blocks and writes them with bwrite().
+struct buf*
+bprivate(uint dev)
+{
+  struct buf *b;
+
+  acquire(&bcache.lock);
+  b = newbuf();
+  release(&bcache.lock);
+  b->dev = dev;
+  return b;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bk;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+
+  bcache.nbuf = NBUF;
+  if(bcache.nbuf == 0)
+    bcache.nbuf = kfreepages() / 16 * (PGSIZE / BSIZE);
+  if(bcache.nbuf < MINNBUF)
+    bcache.nbuf = MINNBUF;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  // Start with every buffer in bucket 0; eviction moves
+  // them to where they belong.
+  acquire(&bcache.lock);
+  for(int i = 0; i < bcache.nbuf; i++)
+    blink(&bcache.bucket[0], newbuf());
+  release(&bcache.lock);
+}
+
+// Look for block on device dev in bucket bk, whose lock
+// must be held. If found, take a reference.
+static struct buf*
+blookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      return b;
+    }
   }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
@@ -58,34 +178,87 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
-  struct buf *b;
+  struct bucket *bk = bhash(dev, blockno), *lbk, *obk;
+  struct buf *b, *lru, *busy;
+
+again:
+  // Is the block already cached?
+  acquire(&bk->lock);
+  b = blookup(bk, dev, blockno);
+  release(&bk->lock);
+  if(b){
+    acquiresleep(&b->lock);
+    return b;
+  }
 
+  // Not cached. Only one process evicts at a time; check
+  // again in case another one cached the block meanwhile.
   acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = blookup(bk, dev, blockno)) != 0){
+    release(&bk->lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  // Recycle the least recently used (LRU) unused buffer,
+  // keeping the lock of the bucket it is on. Skip buffers
+  // the disk is still reading or writing. Each bucket is in
+  // order of release, so only its last unused buffer counts.
+  lru = 0;
+  lbk = 0;
+  busy = 0;
+  for(obk = bcache.bucket; obk < bcache.bucket+NBUCKET; obk++){
+    if(obk != bk)
+      acquire(&obk->lock);
+    int found = 0;
+    for(b = obk->head.prev; b != &obk->head; b = b->prev){
+      if(b->refcnt != 0)
+        continue;
+      if(b->disk){
+        busy = b;
+        continue;
+      }
+      if(lru == 0 || b->lastuse < lru->lastuse){
+        lru = b;
+        found = 1;
+      }
+      break;
     }
+    if(found){
+      if(lbk && lbk != bk)
+        release(&lbk->lock);
+      lbk = obk;
+    } else if(obk != bk){
+      release(&obk->lock);
+    }
+  }
+  if(lru == 0 && busy){
+    // every free buffer is being prefetched; wait for one.
+    if(lbk && lbk != bk)
+      release(&lbk->lock);
+    release(&bk->lock);
+    release(&bcache.lock);
+    virtio_disk_wait(busy);
+    goto again;
   }
+  if(lru == 0)
+    panic("bget: no buffers");
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if(lbk != bk){
+    bunlink(lru);
+    blink(bk, lru);
+    release(&lbk->lock);
   }
-  panic("bget: no buffers");
+  lru->dev = dev;
+  lru->blockno = blockno;
+  lru->valid = 0;
+  lru->refcnt = 1;
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&lru->lock);
+  return lru;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -95,6 +268,7 @@ bread(uint dev, uint blockno)
   struct buf *b;
 
   b = bget(dev, blockno);
+  bwait(b);
   if(!b->valid) {
     virtio_disk_rw(b, 0);
     b->valid = 1;
@@ -102,52 +276,113 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return a locked buf for the indicated block without
+// reading it, for a caller about to overwrite all of it.
+struct buf*
+bfresh(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  bwait(b);
+  b->valid = 1;
+  return b;
+}
+
+// Like bread, but only start reading the block.
+// Call bwait before looking at b->data, or brelse
+// to leave the read running as a prefetch; the next
+// bread of the block waits for it to finish.
+struct buf*
+bread_async(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  if(!b->valid && !b->disk) {
+    virtio_disk_submit(b, 0);
+    b->valid = 1;
+  }
+  return b;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
+  bwait(b);
   virtio_disk_rw(b, 1);
 }
 
+// Start writing b's contents to disk.  Must be locked.
+// b->data must not change until bwait(b) returns,
+// which brelse followed by a later bread also ensures.
+void
+bwrite_async(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  bwait(b);
+  virtio_disk_submit(b, 1);
+}
+
+// Wait for any read or write started on b to finish.
+void
+bwait(struct buf *b)
+{
+  if(b->disk)
+    virtio_disk_wait(b);
+}
+
+// Start the reads and writes queued by bread_async
+// and bwrite_async.
+void
+bkick(void)
+{
+  virtio_disk_kick();
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Move to the head of its bucket, and record
+// when it was last used, for eviction.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = ticks;
+    bunlink(b);
+    blink(bk, b);
   }
-  
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
-
-
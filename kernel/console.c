@@ -7,6 +7,7 @@
 //   control-u -- kill line
 //   control-d -- end of file
 //   control-p -- print process list
+//   control-t -- print kernel statistics
 //
 
 #include <stdarg.h>
@@ -141,6 +142,11 @@ consoleintr(int c)
   case C('P'):  // Print process list.
     procdump();
     break;
+  case C('T'):  // Print kernel statistics.
+    kallocdump();
+    fsdump();
+    wakeupdump();
+    break;
   case C('U'):  // Kill line.
     while(cons.e != cons.w &&
           cons.buf[(cons.e-1) % INPUT_BUF_SIZE] != '\n'){
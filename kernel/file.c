@@ -76,7 +76,15 @@ fileclose(struct file *f)
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
+    if(ff.type == FD_INODE && ff.writable)
+      iwriter(ff.ip, -1);
     begin_op();
+    if(ff.type == FD_INODE && ff.writable){
+      // write out blocks writei() held back.
+      ilock(ff.ip);
+      iflush(ff.ip);
+      iunlock(ff.ip);
+    }
     iput(ff.ip);
     end_op();
   }
@@ -111,6 +119,9 @@ fileread(struct file *f, uint64 addr, int n)
   if(f->readable == 0)
     return -1;
 
+  // the copy below may happen with locks held.
+  uvmprefault(addr, n);
+
   if(f->type == FD_PIPE){
     r = piperead(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -139,6 +150,9 @@ filewrite(struct file *f, uint64 addr, int n)
   if(f->writable == 0)
     return -1;
 
+  // the copy below may happen with locks held.
+  uvmprefault(addr, n);
+
   if(f->type == FD_PIPE){
     ret = pipewrite(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -149,10 +163,12 @@ filewrite(struct file *f, uint64 addr, int n)
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
     // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // and 2 blocks of slop for non-aligned writes, less
+    // what writei() flushing a full window of delayed
+    // blocks may add: the blocks, bitmap and extent blocks.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = ((MAXOPBLOCKS-1-1-2-(NDELAY+2+NXLEVEL)) / 2) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
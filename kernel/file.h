@@ -18,15 +18,35 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *prev; // inode table hash bucket list
+  struct inode *next;
+  uint lastuse;       // ticks when ref last fell to zero
+  int ntext;          // processes running it; see itext()
+  int nwrite;         // open writable files; see iwriter()
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ranext;        // block a sequential reader reads next
+  uint raend;         // blocks below this have been read ahead
+  uint goal;          // where to try to allocate a block next
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  struct extent ext[NEXTENT];
+  uint xaddrs[NXLEVEL];
+  uint dindex;
+  uchar data[NINLINE];
+
+  // appended blocks not yet on disk (see writei()):
+  uint dstart;        // file block held in dpage[0]
+  int ndelay;
+  char *dpage[NDELAY];
+
+  // where the last lookup found its extent, for bmap():
+  uint xgroup;        // extent group (0: the inode's own)
+  uint xbase;         // file block at which that group starts
 };
 
 // map major device number to device functions.
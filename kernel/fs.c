@@ -37,13 +37,20 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+static void bsuminit(int);
+static void isuminit(int);
+
 // Init fs
 void
 fsinit(int dev) {
   readsb(dev, &sb);
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
+  if(sb.bsize != BSIZE)
+    panic("file system block size is not BSIZE");
   initlog(dev, &sb);
+  bsuminit(dev);
+  isuminit(dev);
 }
 
 // Zero a block.
@@ -60,31 +67,170 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Free-block summary, so that balloc() can skip full bitmap
+// blocks without reading them. nfree[i] counts the free blocks
+// in bitmap block i, and is protected by that block's buf lock.
+// rotor is where the last allocation ended, a goal for blocks
+// that have no better one, so that files written one after
+// another are laid out one after another.
+// free counts all free blocks, and reserved those of them that
+// are promised to delayed writes (see writei()); other
+// allocations may only take the rest.
+struct {
+  uint *nfree;
+  uint rotor;
+  struct spinlock lock;  // protects free and reserved
+  uint free;
+  uint reserved;
+} bsum;
+
+// Count the free blocks in each bitmap block.
+static void
+bsuminit(int dev)
+{
+  uint b, bi, nbmap;
+  struct buf *bp;
+
+  initlock(&bsum.lock, "bsum");
+  nbmap = (sb.size + BPB - 1) / BPB;
+  if(nbmap > PGSIZE / sizeof(uint) || (bsum.nfree = (uint*)kalloc()) == 0)
+    panic("bsuminit");
+  bsum.free = 0;
+  for(b = 0; b < sb.size; b += BPB){
+    bp = bread(dev, BBLOCK(b, sb));
+    bsum.nfree[b / BPB] = 0;
+    for(bi = 0; bi < BPB && b + bi < sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        bsum.nfree[b / BPB]++;
+    bsum.free += bsum.nfree[b / BPB];
+    brelse(bp);
+  }
+  bsum.rotor = 0;
+  bsum.reserved = 0;
+}
+
+// Reserve n free blocks for delayed writes, leaving enough
+// for the metadata of the operations in progress.
+// Returns 0 if there is not enough free space.
+static int
+breserve(uint n)
+{
+  int ok;
+
+  acquire(&bsum.lock);
+  ok = bsum.free >= bsum.reserved + n + MAXOPBLOCKS;
+  if(ok)
+    bsum.reserved += n;
+  release(&bsum.lock);
+  return ok;
+}
+
+// Give back n reserved blocks.
+static void
+bunreserve(uint n)
+{
+  acquire(&bsum.lock);
+  bsum.reserved -= n;
+  release(&bsum.lock);
+}
+
+// Allocate a run of up to *n contiguous disk blocks, each
+// zeroed if zero is set, and set *n to its length.
+// File data blocks need not be: writei() zeroes whatever
+// it doesn't write of a block that holds no file data yet.
+// The first resv of the *n blocks were reserved by the
+// caller with breserve(); the run uses those first.
+// The run starts at the first free block at or after goal,
+// wrapping around, so that callers can ask for contiguous
+// blocks. A goal of 0 means no preference.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+ballocrun(uint dev, int zero, uint goal, uint *n, uint resv)
 {
-  int b, bi, m;
+  int i, bi, m;
+  uint b, bb, nbmap, len, want, addr;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
+  // take the blocks from the free count first, so that
+  // concurrent allocations can't overdraw it.
+  acquire(&bsum.lock);
+  want = *n;
+  if(resv > want)
+    resv = want;
+  if(want > bsum.free - bsum.reserved + resv)
+    want = bsum.free - bsum.reserved + resv;
+  if(resv > want)
+    resv = want;
+  bsum.free -= want;
+  bsum.reserved -= resv;
+  release(&bsum.lock);
+
+  if(goal == 0 || goal >= sb.size)
+    goal = bsum.rotor;
+  if(goal >= sb.size)
+    goal = 0;
+  nbmap = (sb.size + BPB - 1) / BPB;
+  addr = 0;
+  len = 0;
+  // visit goal's bitmap block twice: from goal on, and
+  // at the end for the blocks before goal.
+  for(i = 0; i <= nbmap && want > 0 && addr == 0; i++){
+    bb = (goal / BPB + i) % nbmap;
+    if(bsum.nfree[bb] == 0)
+      continue;
+    b = bb * BPB;
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
+    bi = i == 0 ? goal % BPB : 0;
+    while(bi < BPB && b + bi < sb.size){
+      if(bp->data[bi/8] == 0xff){   // skip 8 used blocks
+        bi = (bi/8 + 1) * 8;
+        continue;
+      }
       m = 1 << (bi % 8);
       if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
+        // Mark it and the free blocks after it in use.
+        for(len = 0; len < want && bi + len < BPB && b + bi + len < sb.size; len++){
+          m = 1 << ((bi + len) % 8);
+          if(bp->data[(bi + len)/8] & m)
+            break;
+          bp->data[(bi + len)/8] |= m;
+        }
+        bsum.nfree[bb] -= len;
         log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+        addr = b + bi;
+        break;
       }
+      bi++;
     }
     brelse(bp);
   }
-  printf("balloc: out of blocks\n");
-  return 0;
+
+  // give back what the run didn't use, reserved blocks last.
+  acquire(&bsum.lock);
+  bsum.free += want - len;
+  if(resv > len)
+    bsum.reserved += resv - len;
+  release(&bsum.lock);
+
+  if(addr == 0){
+    printf("balloc: out of blocks\n");
+    return 0;
+  }
+  bsum.rotor = addr + len;
+  if(zero)
+    for(i = 0; i < len; i++)
+      bzero(dev, addr + i);
+  *n = len;
+  return addr;
+}
+
+// Allocate a disk block; see ballocrun().
+static uint
+balloc(uint dev, int zero, uint goal)
+{
+  uint n = 1;
+
+  return ballocrun(dev, zero, goal, &n, 0);
 }
 
 // Free a disk block.
@@ -100,8 +246,13 @@ bfree(int dev, uint b)
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
+  bsum.nfree[b / BPB]++;
+  acquire(&bsum.lock);
+  bsum.free++;
+  release(&bsum.lock);
   log_write(bp);
   brelse(bp);
+  log_free(b);
 }
 
 // Inodes.
@@ -130,17 +281,20 @@ bfree(int dev, uint b)
 //   the reference and link counts have fallen to zero.
 //
 // * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
+//   may be recycled if ip->ref is zero. Otherwise ip->ref
+//   tracks the number of in-memory pointers to the entry
+//   (open files and current directories). iget() finds or
 //   creates a table entry and increments its ref; iput()
-//   decrements ref.
+//   decrements ref. An entry whose ref is zero still holds
+//   its inode until iget() recycles it, least recently
+//   used first, so a later iget() of it need not read it.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   the disk and sets ip->valid, while iget() clears
+//   ip->valid when it recycles the entry, and iput()
+//   when it frees the inode.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -164,53 +318,186 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The table is hashed on (dev, inum) into buckets. A bucket's
+// spin-lock protects the list of entries hashing to it, and
+// their ref, dev, and inum fields, which say whether an entry
+// may be recycled and which i-node it holds; one must hold the
+// bucket lock while using any of those fields. itable.lock
+// serializes recycling, the only code that holds more than one
+// bucket lock. The number of entries is set at boot, from the
+// amount of free memory unless NINODE is given at compile time
+// (make NINODE=n), and they are carved out of kalloc() pages.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+// Directory entry cache: remembers the inum that a name has
+// in a directory, or that it has none (inum 0), so that namex()
+// need not lock and search the directory again. Entries are
+// added and changed only with the directory locked, by namex()
+// after dirlookup() and by dirlink() and dirunlink(), so they
+// agree with the directory. A name may be in any of the DCWAYS
+// entries of its set; a new one replaces the set's least
+// recently used entry.
+#define DCWAYS 4
+#define NDCSET (NDENTRY / DCWAYS)
+
+struct dentry {
+  uint dev;
+  uint dir;           // directory's inum, 0 if unused
+  uint inum;          // 0 if name is not in dir
+  uint lastuse;
+  char name[DIRSIZ];
+};
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct dentry set[NDCSET][DCWAYS];
+  uint clock;
+  uint64 hits, misses;
+} dcache;
+
+#define NIBUCKET 61
+
+struct ibucket {
+  struct spinlock lock;
+  struct inode head;  // inodes hashing here, through prev/next,
+                      // most recently released first
+};
+
+struct {
+  struct spinlock lock;   // recycling
+  int ninode;
+  struct ibucket bucket[NIBUCKET];
 } itable;
 
+static struct ibucket*
+ihash(uint dev, uint inum)
+{
+  return &itable.bucket[(dev * 31 + inum) % NIBUCKET];
+}
+
+static void
+iunlink(struct inode *ip)
+{
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+}
+
+static void
+ilink(struct ibucket *bk, struct inode *ip)
+{
+  ip->next = bk->head.next;
+  ip->prev = &bk->head;
+  bk->head.next->prev = ip;
+  bk->head.next = ip;
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
+  struct ibucket *bk;
+  struct inode *ip;
+  char *page;
+  int i, n;
+
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  initlock(&dcache.lock, "dcache");
+  for(bk = itable.bucket; bk < itable.bucket+NIBUCKET; bk++){
+    initlock(&bk->lock, "itable.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+
+  itable.ninode = NINODE;
+  if(itable.ninode == 0)
+    itable.ninode = kfreepages() / 256 * (PGSIZE / sizeof(struct inode));
+  if(itable.ninode < MININODE)
+    itable.ninode = MININODE;
+
+  // Start with every entry in bucket 0, holding no inode;
+  // iget() moves them to where they belong.
+  for(i = 0; i < itable.ninode; i += n){
+    if((page = kalloc()) == 0)
+      panic("iinit");
+    memset(page, 0, PGSIZE);
+    for(n = 0; n < PGSIZE / sizeof(struct inode) && i + n < itable.ninode; n++){
+      ip = (struct inode*)page + n;
+      initsleeplock(&ip->lock, "inode");
+      ilink(&itable.bucket[0], ip);
+    }
   }
 }
 
 static struct inode* iget(uint dev, uint inum);
+static void dxfree(struct inode*);
+static void dcpurge(struct inode*);
+static void idrop(struct inode*);
+
+// Free-inode summary, so that ialloc() can skip full inode
+// blocks without reading them. nfree[i] counts the free inodes
+// in inode block i; it is only a hint, kept with atomic adds.
+// cursor is the block the last allocation came from.
+struct {
+  uint *nfree;
+  uint cursor;
+} isum;
+
+// Count the free inodes in each inode block.
+static void
+isuminit(int dev)
+{
+  uint inum, nblk;
+  struct buf *bp;
+  struct dinode *dip;
+
+  nblk = (sb.ninodes + IPB - 1) / IPB;
+  if(nblk > PGSIZE / sizeof(uint) || (isum.nfree = (uint*)kalloc()) == 0)
+    panic("isuminit");
+  memset(isum.nfree, 0, PGSIZE);
+  for(inum = 1; inum < sb.ninodes; inum++){
+    bp = bread(dev, IBLOCK(inum, sb));
+    dip = (struct dinode*)bp->data + inum%IPB;
+    if(dip->type == 0)
+      isum.nfree[inum / IPB]++;
+    brelse(bp);
+  }
+  isum.cursor = 0;
+}
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
+// A file goes in or after the inode block of near, the inum
+// of its directory, so that a directory's inodes are read
+// together; a directory goes where the last inode did.
 // Returns an unlocked but allocated and referenced inode,
 // or NULL if there is no free inode.
 struct inode*
-ialloc(uint dev, short type)
+ialloc(uint dev, short type, uint near)
 {
-  int inum;
+  uint inum, blk, start, n, nblk;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
+  nblk = (sb.ninodes + IPB - 1) / IPB;
+  start = type == T_DIR || near == 0 ? isum.cursor : near / IPB;
+  for(n = 0; n < nblk; n++){
+    blk = (start + n) % nblk;
+    if(isum.nfree[blk] == 0)
+      continue;
+    bp = bread(dev, sb.inodestart + blk);
+    for(inum = blk * IPB; inum < (blk + 1) * IPB && inum < sb.ninodes; inum++){
+      dip = (struct dinode*)bp->data + inum%IPB;
+      if(inum > 0 && dip->type == 0){  // a free inode
+        memset(dip, 0, sizeof(*dip));
+        dip->type = type;
+        log_write(bp);   // mark it allocated on the disk
+        brelse(bp);
+        __sync_fetch_and_sub(&isum.nfree[blk], 1);
+        isum.cursor = blk;
+        return iget(dev, inum);
+      }
     }
     brelse(bp);
   }
@@ -235,42 +522,101 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  if(ip->ndelay && dip->size > ip->dstart * BSIZE)
+    dip->size = ip->dstart * BSIZE;  // only what is on disk
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
+  memmove(dip->xaddrs, ip->xaddrs, sizeof(ip->xaddrs));
+  dip->dindex = ip->dindex;
+  memmove(dip->data, ip->data, sizeof(ip->data));
   log_write(bp);
   brelse(bp);
 }
 
+// Look for inode inum on device dev in bucket bk, whose
+// lock must be held. If found, take a reference.
+static struct inode*
+ilookup(struct ibucket *bk, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = bk->head.next; ip != &bk->head; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      ip->ref++;
+      return ip;
+    }
+  }
+  return 0;
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct ibucket *bk = ihash(dev, inum), *lbk, *obk;
+  struct inode *ip, *lru;
 
+  // Is the inode already in the table?
+  acquire(&bk->lock);
+  ip = ilookup(bk, dev, inum);
+  release(&bk->lock);
+  if(ip)
+    return ip;
+
+  // Not there. Only one process recycles at a time; check
+  // again in case another one added the inode meanwhile.
   acquire(&itable.lock);
+  acquire(&bk->lock);
+  if((ip = ilookup(bk, dev, inum)) != 0){
+    release(&bk->lock);
+    release(&itable.lock);
+    return ip;
+  }
 
-  // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
+  // Recycle the least recently used unreferenced entry,
+  // keeping the lock of the bucket it is on. Each bucket
+  // is in order of release, so only its last one counts.
+  lru = 0;
+  lbk = 0;
+  for(obk = itable.bucket; obk < itable.bucket+NIBUCKET; obk++){
+    if(obk != bk)
+      acquire(&obk->lock);
+    int found = 0;
+    for(ip = obk->head.prev; ip != &obk->head; ip = ip->prev){
+      if(ip->ref != 0)
+        continue;
+      if(lru == 0 || ip->lastuse < lru->lastuse){
+        lru = ip;
+        found = 1;
+      }
+      break;
+    }
+    if(found){
+      if(lbk && lbk != bk)
+        release(&lbk->lock);
+      lbk = obk;
+    } else if(obk != bk){
+      release(&obk->lock);
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
-
-  // Recycle an inode entry.
-  if(empty == 0)
+  if(lru == 0)
     panic("iget: no inodes");
 
-  ip = empty;
+  if(lbk != bk){
+    iunlink(lru);
+    ilink(bk, lru);
+    release(&lbk->lock);
+  }
+  ip = lru;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ranext = 0;
+  ip->raend = 0;
+  ip->goal = 0;
+  release(&bk->lock);
   release(&itable.lock);
 
   return ip;
@@ -281,12 +627,32 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk = ihash(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
   ip->ref++;
-  release(&itable.lock);
+  release(&bk->lock);
   return ip;
 }
 
+// Count one more (n=1) or one fewer (n=-1) process whose
+// pages vmfault() loads from ip. While any do, ip may not be
+// opened for writing, since that would change the program
+// under them.
+void
+itext(struct inode *ip, int n)
+{
+  __sync_fetch_and_add(&ip->ntext, n);
+}
+
+// Count one more or one fewer open writable file for ip.
+// While there are any, exec() refuses to run ip.
+void
+iwriter(struct inode *ip, int n)
+{
+  __sync_fetch_and_add(&ip->nwrite, n);
+}
+
 // Lock the given inode.
 // Reads the inode from disk if necessary.
 void
@@ -308,7 +674,12 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    memmove(ip->xaddrs, dip->xaddrs, sizeof(ip->xaddrs));
+    ip->dindex = dip->dindex;
+    memmove(ip->data, dip->data, sizeof(ip->data));
+    ip->xgroup = 0;
+    ip->xbase = 0;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -336,7 +707,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk = ihash(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -345,20 +718,29 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&bk->lock);
 
     itrunc(ip);
+    if(ip->type == T_DIR)
+      dcpurge(ip);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
+    __sync_fetch_and_add(&isum.nfree[ip->inum / IPB], 1);
 
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquire(&bk->lock);
   }
 
   ip->ref--;
-  release(&itable.lock);
+  if(ip->ref == 0){
+    // most recently released first, for recycling.
+    iunlink(ip);
+    ilink(bk, ip);
+    ip->lastuse = ticks;
+  }
+  release(&bk->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -372,52 +754,227 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in blocks on the disk, mapped by extents (see fs.h).
+// The extents come in groups: group 0 is ip->ext[], and
+// group g > 0 is the extent block that extgroup() finds.
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-// returns 0 if out of disk space.
+// Return the block number of extent group g > 0 of ip, or 0
+// if it has none. If alloc is set, allocate the missing
+// extent and indirect blocks, near goal.
 static uint
-bmap(struct inode *ip, uint bn)
+extgroup(struct inode *ip, uint g, int alloc, uint goal)
 {
-  uint addr, *a;
+  uint *ap, addr, idx[NXLEVEL-1];
+  int level, i;
   struct buf *bp;
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[bn] = addr;
-    }
-    return addr;
+  if(g == 1){
+    level = 0;
+  } else if((g -= 2) < NINDIRECT){
+    level = 1;
+    idx[0] = g;
+  } else if((g -= NINDIRECT) < NINDIRECT*NINDIRECT){
+    level = 2;
+    idx[0] = g / NINDIRECT;
+    idx[1] = g % NINDIRECT;
+  } else {
+    return 0;
   }
-  bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
+  ap = &ip->xaddrs[level];
+  if(*ap == 0){
+    // the caller's iupdate() writes the inode.
+    if(!alloc || (*ap = balloc(ip->dev, 1, goal)) == 0)
+      return 0;
+  }
+  addr = *ap;
+  for(i = 0; i < level; i++){
     bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr){
-        a[bn] = addr;
+    ap = (uint*)bp->data + idx[i];
+    if((addr = *ap) == 0){
+      if(alloc && (addr = balloc(ip->dev, 1, goal)) != 0){
+        *ap = addr;
         log_write(bp);
       }
     }
     brelse(bp);
+    if(addr == 0)
+      return 0;
+  }
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If bn is the first block past those mapped and alloc is set,
+// allocate it, preferably right after the file's last block
+// so that it extends the last extent. Up to alloc blocks from
+// bn on are allocated at once, as one contiguous run if disk
+// space allows, so that a big write maps all its blocks with
+// one bitmap search and one extent. resv of them were
+// reserved by the caller; see ballocrun().
+// returns 0 if there is no such block, or if out of disk
+// space or extents.
+// Lookups start from the extent group where the previous one
+// ended, so sequential access does not rescan the file.
+static uint
+extmap(struct inode *ip, uint bn, uint alloc, uint resv)
+{
+  struct extent *x, *e;
+  struct buf *bp;
+  uint g, gbase, base, blk, n, i, addr;
+  uint lastblk, lasti, lastend;
+  int havelast;
+
+  g = 0;
+  base = 0;
+  if(ip->xgroup > 0 && bn >= ip->xbase){
+    g = ip->xgroup;
+    base = ip->xbase;
+  }
+
+  // find bn, or else the first free extent slot.
+  havelast = 0;
+  lastblk = lasti = lastend = 0;
+  for(;; g++){
+    gbase = base;
+    if(g == 0){
+      bp = 0;
+      blk = 0;
+      x = ip->ext;
+      n = NEXTENT;
+    } else {
+      if((blk = extgroup(ip, g, 0, 0)) == 0){
+        i = 0;   // slot 0 of a group yet to be allocated.
+        break;
+      }
+      bp = bread(ip->dev, blk);
+      x = (struct extent*)bp->data;
+      n = NXEXTENT;
+    }
+    for(i = 0; i < n; i++){
+      e = &x[i];
+      if(e->len == 0)
+        break;
+      if(bn < base + e->len){
+        addr = e->start + (bn - base);
+        if(bp)
+          brelse(bp);
+        ip->xgroup = g;
+        ip->xbase = gbase;
+        return addr;
+      }
+      base += e->len;
+      havelast = 1;
+      lastblk = blk;
+      lasti = i;
+      lastend = e->start + e->len;
+    }
+    if(bp)
+      brelse(bp);
+    if(i < n)
+      break;     // slot i of group g is free.
+  }
+
+  if(!alloc || bn != base)
+    return 0;
+
+  n = alloc;
+  addr = ballocrun(ip->dev, ip->type != T_FILE, havelast ? lastend : ip->goal, &n, resv);
+  if(addr == 0)
+    return 0;
+  ip->goal = addr + n;
+
+  if(havelast && addr == lastend){
+    // extends the last extent.
+    if(lastblk == 0){
+      ip->ext[lasti].len += n;
+    } else {
+      bp = bread(ip->dev, lastblk);
+      ((struct extent*)bp->data)[lasti].len += n;
+      log_write(bp);
+      brelse(bp);
+    }
     return addr;
   }
 
-  panic("bmap: out of range");
+  // start a new extent in slot i of group g.
+  if(g == 0){
+    ip->ext[i].start = addr;
+    ip->ext[i].len = n;
+  } else {
+    if((blk = extgroup(ip, g, 1, addr)) == 0){
+      // undo, reservation included, so the caller still has it.
+      resv = min(resv, n);
+      while(n > 0)
+        bfree(ip->dev, addr + --n);
+      acquire(&bsum.lock);
+      bsum.reserved += resv;
+      release(&bsum.lock);
+      return 0;
+    }
+    bp = bread(ip->dev, blk);
+    x = (struct extent*)bp->data;
+    x[i].start = addr;
+    x[i].len = n;
+    log_write(bp);
+    brelse(bp);
+  }
+  ip->xgroup = g;
+  ip->xbase = gbase;
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one.
+// returns 0 if out of disk space.
+static uint
+bmap(struct inode *ip, uint bn)
+{
+  return extmap(ip, bn, 1, 0);
+}
+
+// Return the disk block address of the nth block in inode ip,
+// or 0 if there is none. Unlike bmap, never allocates.
+static uint
+bmapped(struct inode *ip, uint bn)
+{
+  return extmap(ip, bn, 0, 0);
+}
+
+// Free the blocks of extent e.
+static void
+extfree(struct inode *ip, struct extent *e)
+{
+  for(uint k = 0; k < e->len; k++)
+    bfree(ip->dev, e->start + k);
+  e->start = 0;
+  e->len = 0;
+}
+
+// Free block addr, which is an extent block if level is 0,
+// and otherwise a block of pointers to level-1 blocks,
+// along with everything it maps.
+static void
+xfree(struct inode *ip, uint addr, int level)
+{
+  struct buf *bp;
+  uint *a;
+  int i;
+
+  bp = bread(ip->dev, addr);
+  if(level == 0){
+    struct extent *x = (struct extent*)bp->data;
+    for(i = 0; i < NXEXTENT && x[i].len; i++)
+      extfree(ip, &x[i]);
+  } else {
+    a = (uint*)bp->data;
+    for(i = 0; i < NINDIRECT; i++){
+      if(a[i])
+        xfree(ip, a[i], level - 1);
+    }
+  }
+  brelse(bp);
+  bfree(ip->dev, addr);
 }
 
 // Truncate inode (discard contents).
@@ -425,33 +982,131 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
+
+  for(i = 0; i < NEXTENT; i++)
+    extfree(ip, &ip->ext[i]);
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
+  for(i = 0; i < NXLEVEL; i++){
+    if(ip->xaddrs[i]){
+      xfree(ip, ip->xaddrs[i], i);
+      ip->xaddrs[i] = 0;
     }
   }
+  ip->xgroup = 0;
+  ip->xbase = 0;
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+  if(ip->dindex){
+    dxfree(ip);
+    ip->dindex = 0;
   }
+  memset(ip->data, 0, sizeof(ip->data));
+  idrop(ip);
 
   ip->size = 0;
   iupdate(ip);
 }
 
+// Delayed allocation. writei() keeps up to NDELAY blocks
+// appended to a regular file in kalloc()ed pages, dpage[i]
+// holding file block dstart+i, with a disk block reserved for
+// each, and allocates them only when iflush() writes them out:
+// when the window is full, or the file is closed. So a run of
+// small appends costs one bitmap search, one contiguous run
+// and one extent, however many writes it took. Until then the
+// on-disk inode's size stops at dstart, so a crash loses the
+// delayed data but leaves the file consistent.
+
+// Return the page holding ip's delayed block bn, or 0.
+static char*
+delayed(struct inode *ip, uint bn)
+{
+  if(ip->ndelay == 0 || bn < ip->dstart || bn >= ip->dstart + ip->ndelay)
+    return 0;
+  return ip->dpage[bn - ip->dstart];
+}
+
+// Return a page for writei() to write block bn into, if bn is
+// or may become a delayed block. Returns 0 if bn should be
+// written to disk now instead, or (char*)-1 if flushing the
+// full window failed.
+static char*
+delay(struct inode *ip, uint bn)
+{
+  char *page;
+
+  if((page = delayed(ip, bn)) != 0)
+    return page;
+  if(ip->type != T_FILE || bn * BSIZE < ip->size)
+    return 0;
+  if(ip->ndelay == 0 && bmapped(ip, bn))
+    return 0;   // left mapped past EOF by a failed write
+  if(ip->ndelay == NDELAY && iflush(ip) < 0)
+    return (char*)-1;
+  if(!breserve(1))
+    return 0;
+  if((page = kalloc()) == 0){
+    bunreserve(1);
+    return 0;
+  }
+  memset(page, 0, BSIZE);
+  if(ip->ndelay == 0)
+    ip->dstart = bn;
+  ip->dpage[ip->ndelay++] = page;
+  return page;
+}
+
+// Allocate disk blocks for ip's delayed blocks, as one run
+// if possible, and write them.
+// Caller must hold ip->lock and be in a transaction.
+// Returns -1 if there was no room, after dropping the
+// blocks that didn't fit and cutting the file short.
+int
+iflush(struct inode *ip)
+{
+  uint i, addr, left;
+  struct buf *bp;
+
+  if(ip->ndelay == 0)
+    return 0;
+  for(i = 0; i < ip->ndelay; i++){
+    left = ip->ndelay - i;
+    if((addr = extmap(ip, ip->dstart + i, left, left)) == 0)
+      break;
+    bp = bfresh(ip->dev, addr);
+    memmove(bp->data, ip->dpage[i], BSIZE);
+    log_write_data(bp);
+    brelse(bp);
+    kfree(ip->dpage[i]);
+  }
+  if(i < ip->ndelay){
+    printf("iflush: out of blocks\n");
+    if(ip->size > (ip->dstart + i) * BSIZE)
+      ip->size = (ip->dstart + i) * BSIZE;
+    bunreserve(ip->ndelay - i);
+    for(; i < ip->ndelay; i++)
+      kfree(ip->dpage[i]);
+    ip->ndelay = 0;
+    iupdate(ip);
+    return -1;
+  }
+  ip->ndelay = 0;
+  iupdate(ip);
+  return 0;
+}
+
+// Discard ip's delayed blocks, as ip is being truncated.
+static void
+idrop(struct inode *ip)
+{
+  int i;
+
+  for(i = 0; i < ip->ndelay; i++)
+    kfree(ip->dpage[i]);
+  bunreserve(ip->ndelay);
+  ip->ndelay = 0;
+}
+
 // Copy stat information from inode.
 // Caller must hold ip->lock.
 void
@@ -464,27 +1119,90 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Readahead statistics, for fsdump().
+static struct {
+  uint64 issued;   // blocks read ahead
+  uint64 hits;     // sequential reads of a read-ahead block
+  uint64 misses;   // sequential reads of a block not read ahead
+} rastat;
+
+// Start reading the blocks of ip that a sequential reader
+// at block bn will want next, up to READAHEAD blocks ahead.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint end, nblocks, addr;
+  struct buf *bp;
+  int n = 0;
+
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  end = min(bn + READAHEAD, nblocks);
+  if(ip->raend < bn)
+    ip->raend = bn;
+  for(; ip->raend < end; ip->raend++){
+    if((addr = bmapped(ip, ip->raend)) == 0)
+      break;
+    bp = bread_async(ip->dev, addr);
+    brelse(bp);
+    n++;
+  }
+  if(n){
+    bkick();
+    __sync_fetch_and_add(&rastat.issued, n);
+  }
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
+// A read that starts where the previous one ended is
+// taken to be sequential, and starts reading ahead.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, bn;
   struct buf *bp;
+  int seq;
 
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
 
+  if(INLINE(ip) && ip->ndelay == 0){
+    if(either_copyout(user_dst, dst, ip->data + off, n) == -1)
+      return -1;
+    return n;
+  }
+
+  seq = off/BSIZE == ip->ranext || off/BSIZE == ip->ranext - 1;
+  if(!seq)
+    ip->raend = 0;
+
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
+    bn = off/BSIZE;
+    if(seq){
+      if(bn < ip->raend)
+        __sync_fetch_and_add(&rastat.hits, 1);
+      else
+        __sync_fetch_and_add(&rastat.misses, 1);
+      readahead(ip, bn + 1);
+    }
+    m = min(n - tot, BSIZE - off%BSIZE);
+    char *page = delayed(ip, bn);
+    if(page){
+      if(either_copyout(user_dst, dst, page + (off % BSIZE), m) == -1) {
+        tot = -1;
+        break;
+      }
+      continue;
+    }
+    uint addr = bmap(ip, bn);
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
       tot = -1;
@@ -492,9 +1210,19 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     }
     brelse(bp);
   }
+  ip->ranext = (off + BSIZE - 1) / BSIZE;
   return tot;
 }
 
+// Print file system statistics. For ^T on the console.
+void
+fsdump(void)
+{
+  printf("readahead: %lu blocks issued, %lu hits, %lu misses\n",
+         rastat.issued, rastat.hits, rastat.misses);
+  printf("dcache: %lu hits, %lu misses\n", dcache.hits, dcache.misses);
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -505,25 +1233,76 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, bn;
   struct buf *bp;
+  int promote;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  promote = 0;
+  if(INLINE(ip) && ip->ndelay == 0){
+    if(off + n <= NINLINE){
+      if(either_copyin(ip->data + off, user_src, src, n) == -1)
+        return 0;
+      if(off + n > ip->size)
+        ip->size = off + n;
+      iupdate(ip);
+      return n;
+    }
+    // too big: move the contents to block 0, mapped below.
+    promote = ip->size > 0;  // 2 once they are moved
+  }
+
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    uint addr = bmap(ip, off/BSIZE);
+    bn = off/BSIZE;
+    m = min(n - tot, BSIZE - off%BSIZE);
+
+    // appended blocks wait in memory for disk blocks.
+    char *page = promote ? 0 : delay(ip, bn);
+    if(page == (char*)-1)
+      break;
+    if(page){
+      if(either_copyin(page + (off % BSIZE), user_src, src, m) == -1)
+        break;
+      continue;
+    }
+
+    // map the rest of the write's blocks in one go, but
+    // leave those past EOF to delay().
+    uint nb = (off + (n - tot) - 1) / BSIZE - bn + 1;
+    uint eof = (ip->size + BSIZE - 1) / BSIZE;
+    if(ip->type == T_FILE && !promote && bn < eof && bn + nb > eof)
+      nb = eof - bn;
+    uint addr = extmap(ip, bn, nb, 0);
     if(addr == 0)
       break;
-    bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
+    if(promote == 1 || bn * BSIZE >= ip->size){
+      // no file data in it yet, but maybe stale bytes
+      // that a later append or stat()ed size would expose.
+      bp = bfresh(ip->dev, addr);
+      memset(bp->data, 0, BSIZE);
+    } else {
+      bp = bread(ip->dev, addr);
+    }
+    if(promote == 1){
+      memmove(bp->data, ip->data, ip->size);
+      memset(ip->data, 0, sizeof(ip->data));
+      promote = 2;
+    }
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
+      if(promote == 2)
+        log_write_data(bp);  // the old contents, at least
       brelse(bp);
       break;
     }
-    log_write(bp);
+    promote = 0;
+    if(ip->type == T_FILE)
+      log_write_data(bp);   // ordered: written in place, not logged
+    else
+      log_write(bp);
     brelse(bp);
   }
 
@@ -531,8 +1310,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     ip->size = off;
 
   // write the i-node back to disk even if the size didn't change
-  // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
+  // because the loop above might have called extmap() and added a new
+  // block to ip->ext[].
   iupdate(ip);
 
   return tot;
@@ -546,17 +1325,366 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory index: see struct dxroot in fs.h.
+
+static uint
+dxhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261;  // FNV-1a
+  for(i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Give dp, a new directory, an empty index.
+// If there is no room, dp is left without one.
+static void
+dxcreate(struct inode *dp)
+{
+  uint root, leaf;
+  struct buf *bp;
+
+  if((root = balloc(dp->dev, 1, 0)) == 0)
+    return;
+  if((leaf = balloc(dp->dev, 1, root)) == 0){
+    bfree(dp->dev, root);
+    return;
+  }
+  bp = bread(dp->dev, root);
+  ((struct dxroot*)bp->data)->leaf[0] = leaf;
+  log_write(bp);
+  brelse(bp);
+  dp->dindex = root;
+  iupdate(dp);
+}
+
+// Look name up in dp's index. Returns its inode number
+// and sets *poff, returns 0 if name is certainly not in dp,
+// or -1 if dp must be scanned instead.
+static int
+dxlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint h, i, leaf;
+  int inum, overflow;
+  struct buf *bp;
+  struct dxroot *r;
+  struct dxleaf *l;
+  struct dirent de;
+
+  if(dp->dindex == 0)
+    return -1;
+  h = dxhash(name);
+  bp = bread(dp->dev, dp->dindex);
+  r = (struct dxroot*)bp->data;
+  leaf = r->leaf[h & ((1 << r->depth) - 1)];
+  overflow = r->overflow;
+  brelse(bp);
+
+  inum = 0;
+  bp = bread(dp->dev, leaf);
+  l = (struct dxleaf*)bp->data;
+  for(i = 0; i < l->n; i++){
+    if(l->slot[i].hash != h)
+      continue;
+    if(readi(dp, 0, (uint64)&de, l->slot[i].off, sizeof(de)) != sizeof(de))
+      panic("dxlookup read");
+    if(de.inum != 0 && namecmp(name, de.name) == 0){
+      *poff = l->slot[i].off;
+      inum = de.inum;
+      break;
+    }
+  }
+  brelse(bp);
+
+  if(inum == 0 && overflow)
+    return -1;
+  return inum;
+}
+
+// Add the dirent for name at off to dp's index.
+// Splits at most one leaf, so that an insert writes at most
+// the root, two leaves and a bitmap block; if the name's leaf
+// is still full after that, the index overflows.
+static void
+dxinsert(struct inode *dp, char *name, uint off)
+{
+  uint h, i, j, n, bit, leaf, nleaf;
+  int dirty, split;
+  struct buf *rbp, *bp, *nbp;
+  struct dxroot *r;
+  struct dxleaf *l, *nl;
+
+  h = dxhash(name);
+  rbp = bread(dp->dev, dp->dindex);
+  r = (struct dxroot*)rbp->data;
+  dirty = 0;
+  for(split = 0; ; split++){
+    leaf = r->leaf[h & ((1 << r->depth) - 1)];
+    bp = bread(dp->dev, leaf);
+    l = (struct dxleaf*)bp->data;
+    if(l->n < NDXSLOT){
+      l->slot[l->n].hash = h;
+      l->slot[l->n].off = off;
+      l->n++;
+      log_write(bp);
+      brelse(bp);
+      break;
+    }
+
+    // The leaf is full: split it on its next hash bit.
+    n = 1 << r->depth;
+    if(split || (l->depth == r->depth && 2 * n > NDXLEAF)){
+      brelse(bp);
+      r->overflow = 1;
+      dirty = 1;
+      break;
+    }
+    if((nleaf = balloc(dp->dev, 1, leaf)) == 0){
+      brelse(bp);
+      r->overflow = 1;
+      dirty = 1;
+      break;
+    }
+    if(l->depth == r->depth){
+      memmove(&r->leaf[n], &r->leaf[0], n * sizeof(uint));
+      r->depth++;
+    }
+    nbp = bread(dp->dev, nleaf);
+    nl = (struct dxleaf*)nbp->data;
+    bit = 1 << l->depth;
+    l->depth++;
+    nl->depth = l->depth;
+    for(i = j = 0; i < l->n; i++){
+      if(l->slot[i].hash & bit)
+        nl->slot[nl->n++] = l->slot[i];
+      else
+        l->slot[j++] = l->slot[i];
+    }
+    l->n = j;
+    for(i = 0; i < (1 << r->depth); i++)
+      if(r->leaf[i] == leaf && (i & bit))
+        r->leaf[i] = nleaf;
+    dirty = 1;
+    log_write(nbp);
+    brelse(nbp);
+    log_write(bp);
+    brelse(bp);
+  }
+  if(dirty)
+    log_write(rbp);
+  brelse(rbp);
+}
+
+// Remember that the dirent at off in dp is free: on the
+// root's stack of free offsets, or if that is full, by
+// noting that dp has holes that dxslot() must scan for.
+static void
+dxhole(struct inode *dp, uint off)
+{
+  struct buf *bp;
+  struct dxroot *r;
+
+  bp = bread(dp->dev, dp->dindex);
+  r = (struct dxroot*)bp->data;
+  if(r->nfree < NDXFREE)
+    r->free[r->nfree++] = off;
+  else
+    r->holes = 1;
+  log_write(bp);
+  brelse(bp);
+}
+
+// Remove the dirent for name at off from dp's index,
+// and remember that off is free.
+static void
+dxremove(struct inode *dp, char *name, uint off)
+{
+  uint h, i;
+  struct buf *rbp, *bp;
+  struct dxroot *r;
+  struct dxleaf *l;
+
+  h = dxhash(name);
+  rbp = bread(dp->dev, dp->dindex);
+  r = (struct dxroot*)rbp->data;
+  bp = bread(dp->dev, r->leaf[h & ((1 << r->depth) - 1)]);
+  l = (struct dxleaf*)bp->data;
+  for(i = 0; i < l->n; i++){
+    if(l->slot[i].off == off){
+      l->slot[i] = l->slot[--l->n];
+      log_write(bp);
+      break;
+    }
+  }
+  brelse(bp);
+  brelse(rbp);
+  dxhole(dp, off);
+}
+
+// Return the offset of a free dirent in dp,
+// which may be dp->size.
+static uint
+dxslot(struct inode *dp)
+{
+  uint off;
+  struct buf *bp;
+  struct dxroot *r;
+  struct dirent de;
+
+  bp = bread(dp->dev, dp->dindex);
+  r = (struct dxroot*)bp->data;
+  if(r->nfree > 0){
+    off = r->free[--r->nfree];
+    log_write(bp);
+  } else if(r->holes){
+    // more holes than the stack held: look for one.
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dxslot read");
+      if(de.inum == 0)
+        break;
+    }
+    if(off == dp->size){
+      r->holes = 0;
+      log_write(bp);
+    }
+  } else {
+    off = dp->size;
+  }
+  brelse(bp);
+  return off;
+}
+
+// Free dp's index blocks.
+// A leaf appears in leaf[] once for each setting of the
+// hash bits it doesn't use; free it at the first of them.
+static void
+dxfree(struct inode *dp)
+{
+  uint i, leaf, depth;
+  struct buf *rbp, *bp;
+  struct dxroot *r;
+
+  rbp = bread(dp->dev, dp->dindex);
+  r = (struct dxroot*)rbp->data;
+  for(i = 0; i < (1 << r->depth); i++){
+    leaf = r->leaf[i];
+    bp = bread(dp->dev, leaf);
+    depth = ((struct dxleaf*)bp->data)->depth;
+    brelse(bp);
+    if(i < (1 << depth))
+      bfree(dp->dev, leaf);
+  }
+  brelse(rbp);
+  bfree(dp->dev, dp->dindex);
+}
+
+// Directory entry cache: see struct dentry.
+
+static struct dentry*
+dcset(uint dev, uint dir, char *name)
+{
+  return dcache.set[(dxhash(name) + dir * 31 + dev) % NDCSET];
+}
+
+// Find dp's entry for name in dcache.
+// Caller must hold dcache.lock.
+static struct dentry*
+dcfind(struct inode *dp, char *name)
+{
+  struct dentry *d, *set;
+
+  set = dcset(dp->dev, dp->inum, name);
+  for(d = set; d < set + DCWAYS; d++)
+    if(d->dir == dp->inum && d->dev == dp->dev && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// Look name up in dp without locking dp.
+// Returns 0 if dcache doesn't know it. Otherwise returns 1,
+// with *ipp set to name's inode, or to 0 if there is none.
+static int
+dclookup(struct inode *dp, char *name, struct inode **ipp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp, name)) == 0){
+    dcache.misses++;
+    release(&dcache.lock);
+    return 0;
+  }
+  d->lastuse = ++dcache.clock;
+  dcache.hits++;
+  // take the reference before an unlink can change d.
+  *ipp = d->inum ? iget(dp->dev, d->inum) : 0;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name has inode inum in dp, or none if inum is 0.
+// Caller must hold dp->lock.
+static void
+dcenter(struct inode *dp, char *name, uint inum)
+{
+  struct dentry *d, *set;
+  int i;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp, name)) == 0){
+    set = dcset(dp->dev, dp->inum, name);
+    d = &set[0];
+    for(i = 1; i < DCWAYS && d->dir; i++)
+      if(set[i].dir == 0 || set[i].lastuse < d->lastuse)
+        d = &set[i];
+    d->dev = dp->dev;
+    d->dir = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+  }
+  d->inum = inum;
+  d->lastuse = ++dcache.clock;
+  release(&dcache.lock);
+}
+
+// Forget dp's entries, as dp is being freed.
+static void
+dcpurge(struct inode *dp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = &dcache.set[0][0]; d < &dcache.set[NDCSET][0]; d++)
+    if(d->dir == dp->inum && d->dev == dp->dev)
+      d->dir = 0;
+  release(&dcache.lock);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
+  uint off;
+  int inum;
   struct dirent de;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if((inum = dxlookup(dp, name, &off)) >= 0){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -589,22 +1717,49 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  if(dp->dindex == 0 && dp->size == 0)
+    dxcreate(dp);
+
+  if(dp->dindex){
+    off = dxslot(dp);
+  } else {
+    // Look for an empty dirent.
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0)
+        break;
+    }
   }
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de)){
+    if(dp->dindex && off < dp->size)
+      dxhole(dp, off);  // dxslot() took it
     return -1;
+  }
+  if(dp->dindex)
+    dxinsert(dp, name, off);
+  dcenter(dp, name, inum);
 
   return 0;
 }
 
+// Remove the directory entry for name, at offset off, from dp.
+void
+dirunlink(struct inode *dp, char *name, uint off)
+{
+  struct dirent de;
+
+  memset(&de, 0, sizeof(de));
+  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+    panic("dirunlink: writei");
+  if(dp->dindex)
+    dxremove(dp, name, off);
+  dcenter(dp, name, 0);
+}
+
 // Paths
 
 // Copy the next path element from path into name.
@@ -659,6 +1814,13 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    if((!nameiparent || *path != '\0') && dclookup(ip, name, &next)){
+      iput(ip);
+      if(next == 0)
+        return 0;
+      ip = next;
+      continue;
+    }
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
@@ -669,7 +1831,9 @@ namex(char *path, int nameiparent, char *name)
       iunlock(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
+    next = dirlookup(ip, name, 0);
+    dcenter(ip, name, next ? next->inum : 0);
+    if(next == 0){
       iunlockput(ip);
       return 0;
     }
@@ -3,7 +3,9 @@
 
 
 #define ROOTINO  1   // root i-number
-#define BSIZE 1024  // block size
+#ifndef BSIZE
+#define BSIZE 4096  // block size; make BSIZE=n to change
+#endif
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
@@ -20,13 +22,35 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint bsize;        // Block size (bytes); must be BSIZE
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+// A file's blocks are mapped by extents: runs of len consecutive
+// disk blocks starting at block start. Extents map the file's
+// blocks in order, so extent i starts where extent i-1 ended in
+// the file. The first NEXTENT extents are in the inode. The rest
+// are in extent blocks of NXEXTENT each, reached through the
+// inode's xaddrs[]: xaddrs[0] is an extent block, xaddrs[1] a
+// block of NINDIRECT extent block numbers (double-indirect), and
+// xaddrs[2] a block of NINDIRECT such blocks (triple-indirect).
+struct extent {
+  uint start;
+  uint len;     // 0 if unused
+};
+
+#define NEXTENT 4
+#define NXEXTENT (BSIZE / sizeof(struct extent))
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NXLEVEL 3
+#define MAXFILE (8*1024*1024 / BSIZE)  // max file size, in blocks (8MB)
+
+// A regular file of at most NINLINE bytes keeps its contents in
+// its inode's data[] rather than in a block, as long as it has
+// no blocks; writei() moves them to block 0 when it grows.
+#define NINLINE 68
+#define INLINE(ip) ((ip)->type == T_FILE && (ip)->ext[0].len == 0)
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +59,10 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  struct extent ext[NEXTENT]; // Data block extents
+  uint xaddrs[NXLEVEL]; // Extent blocks, 1-3 levels of indirection
+  uint dindex;          // Hashed name index (T_DIR only), or 0
+  uchar data[NINLINE];  // Contents, if INLINE
 };
 
 // Inodes per block.
@@ -58,3 +85,41 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// A directory may also have a hashed index of its entries, so
+// that a lookup need not read the whole directory. The index is
+// an extendible hash table: dinode.dindex is a root block whose
+// leaf[] has 1<<depth entries, and a name's leaf is
+// leaf[hash & ((1<<depth)-1)]. A leaf holds the (hash, offset)
+// of each of its entries; when a leaf fills it splits on the
+// next hash bit, doubling leaf[] if needed. If that can't be
+// done, overflow is set and lookups of names not in the index
+// fall back to scanning the directory. The root also remembers
+// the offsets of free dirents for reuse; if there are more than
+// it has room for, it notes that the directory has holes, and
+// they are found by scanning when the remembered ones run out.
+// Directories without an index are scanned, as always.
+#define NDXLEAF (BSIZE / 8)  // most leaf pointers (a power of 2)
+#define NDXFREE ((BSIZE / 2 - 4 * sizeof(uint)) / sizeof(uint))
+
+struct dxroot {
+  uint depth;           // leaf[] has 1<<depth entries
+  uint overflow;        // some dirents are not in the index
+  uint holes;           // some free dirents are not in free[]
+  uint nfree;
+  uint free[NDXFREE];   // offsets of free dirents
+  uint leaf[NDXLEAF];   // leaf block numbers
+};
+
+struct dxslot {
+  uint hash;
+  uint off;             // byte offset of the dirent
+};
+
+#define NDXSLOT ((BSIZE - 2 * sizeof(uint)) / sizeof(struct dxslot))
+
+struct dxleaf {
+  uint depth;           // hash bits shared by this leaf's entries
+  uint n;
+  struct dxslot slot[NDXSLOT];
+};
+
@@ -1,6 +1,19 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Each CPU keeps its own free list, so the common
+// kalloc()/kfree() path only takes that CPU's lock.
+// Pages move between a CPU's list and a shared pool
+// KBATCH at a time: a CPU with an empty list refills
+// from the pool (or, if the pool is empty too, steals
+// from another CPU), and a CPU whose list grows past
+// KHIWAT drains a batch back to the pool.
+//
+// Pages can be shared copy-on-write after fork(), so each
+// physical page has a reference count. kalloc() sets it to
+// one, krefinc() adds a reference, and kfree() only returns
+// the page to a free list when the last reference goes away.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +22,9 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define KBATCH 32           // pages moved per refill, drain, or steal
+#define KHIWAT (2*KBATCH)   // drain to the pool above this many pages
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -18,15 +34,28 @@ struct run {
   struct run *next;
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;         // pages on freelist
+  uint64 ncontend;   // acquires that found the lock already held
+  uint64 nrefill;    // batches taken from the pool
+  uint64 nsteal;     // batches taken from another CPU
+};
+
+struct kmem kmem[NCPU];  // per-CPU free lists
+struct kmem kpool;       // shared pool
+
+// reference counts, indexed by physical page number.
+static int kref[(PHYSTOP - KERNBASE) / PGSIZE];
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&kpool.lock, "kpool");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,31 +64,151 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    kref[PA2REF(p)] = 1;
     kfree(p);
+  }
+}
+
+// Acquire km->lock, counting the acquire as contended
+// if some other CPU holds it. The check is racy, but
+// it is only a statistic.
+static void
+kacquire(struct kmem *km)
+{
+  if(km->lock.locked)
+    __sync_fetch_and_add(&km->ncontend, 1);
+  acquire(&km->lock);
+}
+
+// Detach up to n pages from km's free list and return
+// them as a chain, setting *tail to its last element.
+// Caller must hold km->lock.
+static struct run*
+ktake(struct kmem *km, int n, struct run **tail)
+{
+  struct run *head, *r;
+  int i;
+
+  head = km->freelist;
+  if(head == 0)
+    return 0;
+  r = head;
+  for(i = 1; i < n && r->next; i++)
+    r = r->next;
+  km->freelist = r->next;
+  km->nfree -= i;
+  r->next = 0;
+  *tail = r;
+  return head;
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
+// Push the chain head..tail of n pages onto km's free list.
+// Caller must hold km->lock.
+static void
+kput(struct kmem *km, struct run *head, struct run *tail, int n)
+{
+  tail->next = km->freelist;
+  km->freelist = head;
+  km->nfree += n;
+}
+
+// Count the pages in a chain returned by ktake().
+static int
+kcount(struct run *r)
+{
+  int n;
+
+  for(n = 0; r; r = r->next)
+    n++;
+  return n;
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page is freed when its last reference is dropped.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *head, *tail;
+  struct kmem *km;
+  int ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((ref = __sync_sub_and_fetch(&kref[PA2REF(pa)], 1)) > 0)
+    return;
+  if(ref < 0)
+    panic("kfree: ref");
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  km = &kmem[cpuid()];
+  kacquire(km);
+  r->next = km->freelist;
+  km->freelist = r;
+  km->nfree++;
+  head = 0;
+  if(km->nfree > KHIWAT)
+    head = ktake(km, KBATCH, &tail);
+  release(&km->lock);
+
+  if(head){
+    kacquire(&kpool);
+    kput(&kpool, head, tail, KBATCH);
+    release(&kpool.lock);
+  }
+  pop_off();
+}
+
+// Refill the free list of CPU id, which has run dry,
+// from the pool or from another CPU. Returns one page
+// for the caller, or 0 if there is no free memory.
+// Interrupts must be disabled.
+static struct run*
+krefill(int id)
+{
+  struct run *head, *tail;
+  struct kmem *km = &kmem[id];
+  int i, n;
+
+  kacquire(&kpool);
+  head = ktake(&kpool, KBATCH, &tail);
+  release(&kpool.lock);
+
+  if(head){
+    km->nrefill++;
+  } else {
+    // Steal half of some other CPU's list.
+    for(i = 1; i < NCPU && head == 0; i++){
+      struct kmem *victim = &kmem[(id + i) % NCPU];
+      if(victim->nfree == 0)
+        continue;
+      kacquire(victim);
+      n = victim->nfree / 2;
+      head = ktake(victim, n > 0 ? n : 1, &tail);
+      release(&victim->lock);
+    }
+    if(head == 0)
+      return 0;
+    km->nsteal++;
+  }
+
+  // Keep the first page for the caller, and
+  // stock this CPU's list with the rest.
+  if(head != tail){
+    kacquire(km);
+    kput(km, head->next, tail, kcount(head->next));
+    release(&km->lock);
+  }
+  return head;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +218,70 @@ void *
 kalloc(void)
 {
   struct run *r;
+  struct kmem *km;
+  int id;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  km = &kmem[id];
+  kacquire(km);
+  r = km->freelist;
+  if(r){
+    km->freelist = r->next;
+    km->nfree--;
+  }
+  release(&km->lock);
+  if(r == 0)
+    r = krefill(id);
+  pop_off();
 
-  if(r)
+  if(r){
+    kref[PA2REF(r)] = 1;
     memset((char*)r, 5, PGSIZE); // fill with junk
+  }
   return (void*)r;
 }
+
+// Add a reference to the allocated page pa.
+void
+krefinc(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefinc");
+  if(__sync_fetch_and_add(&kref[PA2REF(pa)], 1) < 1)
+    panic("krefinc: free page");
+}
+
+// Return the number of references to the allocated page pa.
+int
+krefcnt(void *pa)
+{
+  return kref[PA2REF(pa)];
+}
+
+// Number of free pages. Only a snapshot, since
+// it runs without locks.
+uint64
+kfreepages(void)
+{
+  uint64 n = kpool.nfree;
+
+  for(int i = 0; i < NCPU; i++)
+    n += kmem[i].nfree;
+  return n;
+}
+
+// Print allocator statistics to the console.
+// For debugging; runs without locks.
+void
+kallocdump(void)
+{
+  printf("kalloc: pool free %d contended %lu\n", kpool.nfree, kpool.ncontend);
+  for(int i = 0; i < NCPU; i++){
+    struct kmem *km = &kmem[i];
+    if(km->nfree == 0 && km->ncontend == 0 && km->nrefill == 0 && km->nsteal == 0)
+      continue;
+    printf("kalloc: cpu %d free %d contended %lu refills %lu steals %lu\n",
+           i, km->nfree, km->ncontend, km->nrefill, km->nsteal);
+  }
+}
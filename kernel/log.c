@@ -21,105 +21,221 @@
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
 //
+// The log is double-buffered. To commit, the last end_op()
+// copies the transaction's blocks out of the buffer cache
+// into the log's own staging bufs, which takes no disk I/O
+// and is the only time begin_op() has to wait. A new
+// transaction then opens while the old one is written to the
+// log and installed from the staging copies. If the new
+// transaction is idle by the time that finishes, the
+// committer commits it as well, so system calls that end
+// while the disk is busy are committed as a group.
+//
+// File data is not journaled (ordered mode): writei() writes
+// a T_FILE's data blocks straight to their home locations with
+// log_write_data(), before the transaction that allocated them
+// commits, and only metadata goes through the log. A data block
+// is still logged if it is part of a logged transaction that
+// recovery might still replay, or was freed by a transaction
+// that has not committed, since writing it in place could then
+// be undone by recovery or show up in the file that freed it.
+//
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+//   header block, containing a sequence number, a checksum,
+//     and block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// The checksum covers the header and blocks A, B, C, so the log
+// blocks and the header are written as one batch: the
+// transaction has committed once all of them are on disk, and
+// recovery replays it only if the checksum matches. Replaying
+// is idempotent, so the header is never erased; the next commit
+// overwrites it, and a torn overwrite fails the checksum, by
+// which time the old transaction has been installed anyway.
+// Installing to home locations is a second batch.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
+  uint seq;    // number of the transaction
+  uint sum;    // checksum of seq, n, block[] and the logged blocks
   int n;
-  int block[LOGSIZE];
+  int block[];  // as many as fit in a block
 };
 
+// blocks freed by a transaction, remembered until it commits.
+// more than NFREED makes all file data journaled until then.
+#define NFREED 64
+
 struct log {
   struct spinlock lock;
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int committing;  // some end_op() is in commit().
+  int snapshot;    // commit() is copying the open transaction; please wait.
   int dev;
-  struct logheader lh;
+  int cap;         // max blocks per transaction: sb->nlog-1,
+                   // or fewer if the buffer cache is small
+  uint seq;              // seq of the next transaction to commit
+  struct logheader *dlh; // the last committed transaction
+  struct logheader *lh;  // the open transaction
+  int nfreed;            // blocks it has freed, or NFREED+1
+  int freed[NFREED];
+
+  // the transaction being committed. only the committer uses these.
+  struct logheader *clh;
+  int cnfreed;
+  int cfreed[NFREED];
+  struct buf **stage;    // copies of its blocks
+  struct buf **pinned;   // their pinned cache bufs
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
 
+// Allocate a zeroed page for the log's in-memory state.
+static void*
+logpage(void)
+{
+  void *p;
+
+  if ((p = kalloc()) == 0)
+    panic("initlog: kalloc");
+  memset(p, 0, PGSIZE);
+  return p;
+}
+
+// Set up the log from the superblock, which says how
+// big it is, and recover from a crash if need be.
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
-
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  log.cap = log.size - 1;
   log.dev = dev;
+  if (log.cap < MAXOPBLOCKS ||
+      sizeof(struct logheader) + log.cap*sizeof(int) > BSIZE ||
+      log.cap*sizeof(struct buf*) > PGSIZE)
+    panic("initlog: bad log size");
+  // the open and the committing transaction each keep up to
+  // cap blocks pinned in the cache, and the operations in
+  // progress need up to MAXOPBLOCKS more to read through.
+  // begin_op() admits whole operations, so a cap that is
+  // not a multiple of MAXOPBLOCKS would only waste bufs.
+  if (2*log.cap + MAXOPBLOCKS > bcachesize())
+    log.cap = (bcachesize() - MAXOPBLOCKS) / 2 / MAXOPBLOCKS * MAXOPBLOCKS;
+  if (log.cap < MAXOPBLOCKS)
+    panic("initlog: too few bufs for the log; raise NBUF");
+
+  log.lh = logpage();
+  log.clh = logpage();
+  log.dlh = logpage();
+  log.stage = logpage();
+  log.pinned = logpage();
+  for (int i = 0; i < log.cap; i++)
+    log.stage[i] = bprivate(dev);
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
+// Copy header src, with its block list, to dst.
 static void
-install_trans(int recovering)
+copyhead(struct logheader *dst, struct logheader *src)
+{
+  memmove(dst, src, sizeof(*src) + src->n*sizeof(src->block[0]));
+}
+
+// Copy committed blocks from log to their home location,
+// after a crash.
+static void
+recover_trans(void)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
+  for (tail = 0; tail < log.lh->n; tail++) {
     struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
+    struct buf *dbuf = bread(log.dev, log.lh->block[tail]); // read dst
     memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
     bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
     brelse(lbuf);
     brelse(dbuf);
   }
 }
 
-// Read the log header from disk into the in-memory log header
-static void
-read_head(void)
+// FNV-1a, continuing from h.
+static uint
+cksum(uint h, void *p, int n)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  uchar *c = p;
+
+  while (n-- > 0) {
+    h ^= *c++;
+    h *= 16777619;
   }
-  brelse(buf);
+  return h;
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void
-write_head(void)
+// Start the checksum of a transaction with its header.
+static uint
+headsum(struct logheader *lh)
+{
+  uint h = 2166136261;
+
+  h = cksum(h, &lh->seq, sizeof(lh->seq));
+  h = cksum(h, &lh->n, sizeof(lh->n));
+  return cksum(h, lh->block, lh->n * sizeof(lh->block[0]));
+}
+
+// Read the log header from disk into the in-memory log header.
+// Returns 0 if it does not describe a whole, committed
+// transaction.
+static int
+read_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  uint sum;
+
+  log.lh->seq = lh->seq;
+  log.lh->sum = lh->sum;
+  log.lh->n = lh->n;
+  if (log.lh->n <= 0 || log.lh->n > log.size - 1) {
+    log.lh->n = 0;
+    brelse(buf);
+    return 0;
+  }
+  for (i = 0; i < log.lh->n; i++) {
+    log.lh->block[i] = lh->block[i];
   }
-  bwrite(buf);
   brelse(buf);
+
+  sum = headsum(log.lh);
+  for (i = 0; i < log.lh->n; i++) {
+    buf = bread(log.dev, log.start+i+1);
+    sum = cksum(sum, buf->data, BSIZE);
+    brelse(buf);
+  }
+  return sum == log.lh->sum;
 }
 
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  int ok = read_head();
+
+  log.seq = log.lh->seq + 1;
+  if (ok) {
+    recover_trans(); // if committed, copy from log to disk
+    copyhead(log.dlh, log.lh);
+  }
+  log.lh->n = 0;
 }
 
 // called at the start of each FS system call.
@@ -128,9 +244,9 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.snapshot){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh->n + (log.outstanding+1)*MAXOPBLOCKS > log.cap){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
@@ -142,7 +258,9 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation,
+// unless another commit is under way, in which case
+// that committer will pick the transaction up.
 void
 end_op(void)
 {
@@ -150,9 +268,9 @@ end_op(void)
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  if(log.snapshot)
+    panic("log.snapshot");
+  if(log.outstanding == 0 && !log.committing){
     do_commit = 1;
     log.committing = 1;
   } else {
@@ -167,39 +285,117 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy the blocks of the open transaction, which has no
+// outstanding operations, from the cache to the staging
+// bufs, and make it the committing transaction.
+// begin_op() waits while this runs.
 static void
-write_log(void)
+snapshot(void)
 {
-  int tail;
+  int i;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
+  for (i = 0; i < log.clh->n; i++) {
+    struct buf *from = bread(log.dev, log.clh->block[i]); // pinned cache block
+    struct buf *to = log.stage[i];
+    acquiresleep(&to->lock);
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    log.pinned[i] = from;
     brelse(from);
-    brelse(to);
   }
 }
 
+// Write the staged blocks and the header to the log, as
+// one batch of disk requests. Once they are all on disk,
+// the transaction has committed.
+static void
+write_log(void)
+{
+  struct buf *hbuf;
+  struct logheader *hb;
+  int tail;
+
+  log.clh->seq = log.seq++;
+  log.clh->sum = headsum(log.clh);
+  for (tail = 0; tail < log.clh->n; tail++) {
+    struct buf *b = log.stage[tail];
+    log.clh->sum = cksum(log.clh->sum, b->data, BSIZE);
+    b->blockno = log.start+tail+1; // log block
+    bwrite_async(b);  // write the log
+  }
+
+  hbuf = bread(log.dev, log.start);
+  hb = (struct logheader *) (hbuf->data);
+  hb->seq = log.clh->seq;
+  hb->sum = log.clh->sum;
+  hb->n = log.clh->n;
+  for (tail = 0; tail < log.clh->n; tail++) {
+    hb->block[tail] = log.clh->block[tail];
+  }
+  bwrite_async(hbuf);
+
+  for (tail = 0; tail < log.clh->n; tail++)
+    bwait(log.stage[tail]);
+  bwait(hbuf);
+  brelse(hbuf);
+}
+
+// Copy the staged blocks to their home locations, as one
+// batch of disk requests, and let the cache evict them.
+static void
+install_trans(void)
+{
+  int tail;
+
+  for (tail = 0; tail < log.clh->n; tail++) {
+    struct buf *b = log.stage[tail];
+    b->blockno = log.clh->block[tail];
+    bwrite_async(b);  // write dst to disk
+  }
+  for (tail = 0; tail < log.clh->n; tail++) {
+    struct buf *b = log.stage[tail];
+    bwait(b);
+    releasesleep(&b->lock);
+    bunpin(log.pinned[tail]);
+  }
+}
+
+// Commit the open transaction, and then any transaction
+// that has gone idle while this one was being written.
+// Caller has set log.committing.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  acquire(&log.lock);
+  while (log.outstanding == 0 && log.lh->n > 0) {
+    copyhead(log.clh, log.lh);
+    log.lh->n = 0;
+    memmove(log.cfreed, log.freed, sizeof(log.freed));
+    log.cnfreed = log.nfreed;
+    log.nfreed = 0;
+    log.snapshot = 1;
+    release(&log.lock);
+
+    snapshot();
+
+    acquire(&log.lock);
+    log.snapshot = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    write_log();      // Write staged blocks and header -- the real commit
+    install_trans();  // Now install writes to home locations
+
+    acquire(&log.lock);
+    copyhead(log.dlh, log.clh); // recovery may replay it until the next commit
+    log.clh->n = 0;
+    log.cnfreed = 0;
   }
+  log.committing = 0;
+  wakeup(&log);
+  release(&log.lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -217,20 +413,81 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh->n >= log.cap)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorption
+  for (i = 0; i < log.lh->n; i++) {
+    if (log.lh->block[i] == b->blockno)   // log absorption
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  log.lh->block[i] = b->blockno;
+  if (i == log.lh->n) {  // Add new block to log?
     bpin(b);
-    log.lh.n++;
+    log.lh->n++;
   }
   release(&log.lock);
 }
 
+
+// Is blockno in the open transaction, the committing one, or
+// the last committed one (which recovery would replay), or
+// freed by one that has not committed?
+// Caller holds log.lock.
+static int
+log_contains(uint blockno)
+{
+  int i;
+
+  if (log.nfreed > NFREED || log.cnfreed > NFREED)
+    return 1;
+  for (i = 0; i < log.lh->n; i++)
+    if (log.lh->block[i] == blockno)
+      return 1;
+  for (i = 0; i < log.clh->n; i++)
+    if (log.clh->block[i] == blockno)
+      return 1;
+  for (i = 0; i < log.dlh->n; i++)
+    if (log.dlh->block[i] == blockno)
+      return 1;
+  for (i = 0; i < log.nfreed; i++)
+    if (log.freed[i] == blockno)
+      return 1;
+  for (i = 0; i < log.cnfreed; i++)
+    if (log.cfreed[i] == blockno)
+      return 1;
+  return 0;
+}
+
+// Like log_write(), but for a block of file data: write
+// it to its home location right away, unless the block
+// has to go through the log (see the top of this file).
+void
+log_write_data(struct buf *b)
+{
+  int logged;
+
+  acquire(&log.lock);
+  if (log.outstanding < 1)
+    panic("log_write_data outside of trans");
+  logged = log_contains(b->blockno);
+  release(&log.lock);
+
+  if (logged)
+    log_write(b);
+  else
+    bwrite(b);
+}
+
+// Remember that the open transaction freed blockno.
+void
+log_free(uint blockno)
+{
+  acquire(&log.lock);
+  if (log.nfreed < NFREED)
+    log.freed[log.nfreed++] = blockno;
+  else
+    log.nfreed = NFREED+1;
+  release(&log.lock);
+}
@@ -2,14 +2,24 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#ifndef NINODE
+#define NINODE        0  // in-memory i-nodes; 0 sizes the table from free memory
+#endif
+#define MININODE     50  // fewest in-memory i-nodes
+#define NDENTRY     256  // directory entry cache size
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define MAXOPBLOCKS  24  // max # of blocks any FS op writes
+#define LOGSIZE      (MAXOPBLOCKS*3+1)  // mkfs's default on-disk log blocks, with header
+#ifndef NBUF
+#define NBUF         0     // disk block cache size; 0 sizes it from free memory
+#endif
+#define MINNBUF      (MAXOPBLOCKS*8)  // smallest disk block cache
+#define FSSIZE       (12*1024*1024 / BSIZE)  // size of file system in blocks (12MB)
 #define MAXPATH      128   // maximum file path name
 #define USERSTACK    1     // user stack pages
+#define READAHEAD    8     // blocks read ahead of a sequential reader
+#define NDELAY       4     // appended blocks a file holds before allocating them
+#define NSEG         4     // demand-paged ELF segments per process
 
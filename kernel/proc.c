@@ -10,6 +10,42 @@ struct cpu cpus[NCPU];
 
 struct proc proc[NPROC];
 
+// Per-CPU queues of RUNNABLE processes, in FIFO order.
+// A process is on a queue exactly when it is RUNNABLE
+// and not yet chosen by a scheduler.
+// Lock order: p->lock, then a run queue lock.
+struct runq {
+  struct spinlock lock;
+  struct proc *head;
+  struct proc *tail;
+  int n;
+} runq[NCPU];
+
+// Processes sleeping in sleep(), in a hash table keyed
+// by channel, so wakeup() only looks at those that might
+// be sleeping on its channel.
+// Lock order: the sleep lock passed to sleep(), then a
+// wait queue lock, then p->lock.
+#define NWAITQ 31
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitq[NWAITQ];
+
+// wakeup() costs, for wakeupdump().
+static struct {
+  uint64 calls;
+  uint64 scanned;  // sleepers looked at
+  uint64 woken;
+} wakestat;
+
+static struct waitq*
+chanq(void *chan)
+{
+  return &waitq[((uint64)chan >> 3) % NWAITQ];
+}
+
 struct proc *initproc;
 
 int nextpid = 1;
@@ -17,6 +53,7 @@ struct spinlock pid_lock;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void setrunnable(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
@@ -51,6 +88,10 @@ procinit(void)
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
@@ -162,6 +203,7 @@ freeproc(struct proc *p)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   p->sz = 0;
+  p->nseg = 0;
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
@@ -249,12 +291,15 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  p->cpu = 0;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growth is lazy: only p->sz moves, and vmfault()
+// allocates each new page when it is first touched.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -264,9 +309,9 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(sz + n < sz || sz + n > TRAPFRAME)
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
@@ -307,6 +352,12 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  if(p->exe){
+    np->exe = idup(p->exe);
+    itext(np->exe, 1);
+  }
+  memmove(np->segs, p->segs, sizeof(p->segs));
+  np->nseg = p->nseg;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -319,7 +370,8 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  np->cpu = cpuid();
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -362,8 +414,13 @@ exit(int status)
 
   begin_op();
   iput(p->cwd);
+  if(p->exe){
+    itext(p->exe, -1);
+    iput(p->exe);
+  }
   end_op();
   p->cwd = 0;
+  p->exe = 0;
 
   acquire(&wait_lock);
 
@@ -434,6 +491,52 @@ wait(uint64 addr)
   }
 }
 
+// Mark p RUNNABLE and append it to the run queue of
+// the CPU it last ran on.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *rq = &runq[p->cpu];
+
+  if(!holding(&p->lock))
+    panic("setrunnable");
+  p->state = RUNNABLE;
+  p->rqnext = 0;
+  acquire(&rq->lock);
+  if(rq->tail)
+    rq->tail->rqnext = p;
+  else
+    rq->head = p;
+  rq->tail = p;
+  rq->n++;
+  release(&rq->lock);
+}
+
+// Remove and return the first process on CPU id's run
+// queue, or 0 if it is empty.
+static struct proc*
+dequeue(int id)
+{
+  struct runq *rq = &runq[id];
+  struct proc *p;
+
+  // peek without the lock, so that idle CPUs looking for
+  // work don't bounce every queue's lock around.
+  if(*(volatile int *)&rq->n == 0)
+    return 0;
+  acquire(&rq->lock);
+  if((p = rq->head) != 0){
+    rq->head = p->rqnext;
+    if(rq->head == 0)
+      rq->tail = 0;
+    rq->n--;
+    p->rqnext = 0;
+  }
+  release(&rq->lock);
+  return p;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -446,6 +549,7 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
 
   c->proc = 0;
   for(;;){
@@ -454,29 +558,37 @@ scheduler(void)
     // processes are waiting.
     intr_on();
 
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-        found = 1;
-      }
-      release(&p->lock);
-    }
-    if(found == 0) {
+    // Take the next process from this CPU's queue, or
+    // steal one from another CPU's.
+    p = dequeue(id);
+    for(int i = 1; p == 0 && i < NCPU; i++)
+      p = dequeue((id + i) % NCPU);
+
+    if(p == 0) {
       // nothing to run; stop running on this core until an interrupt.
       intr_on();
       asm volatile("wfi");
+      continue;
     }
+
+    // Nothing else changes the state of a RUNNABLE process
+    // that is on no queue, so p is still RUNNABLE.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = id;
+    c->proc = p;
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -513,7 +625,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -548,24 +660,29 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *wq = chanq(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // Once we hold p->lock and are on chan's wait queue,
+  // we can be guaranteed that we won't miss any wakeup
+  // (wakeup locks the wait queue and p->lock),
   // so it's okay to release lk.
 
+  acquire(&wq->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->wqnext = wq->head;
+  wq->head = p;
+  release(&wq->lock);
 
   sched();
 
-  // Tidy up.
+  // Tidy up. Whoever woke us took us off the wait queue.
   p->chan = 0;
 
   // Reacquire original lock.
@@ -573,22 +690,51 @@ sleep(void *chan, struct spinlock *lk)
   acquire(lk);
 }
 
+// Take p off wait queue wq and make it RUNNABLE,
+// if it is still sleeping on chan.
+// Caller must hold wq->lock and p->lock.
+static int
+unsleep(struct waitq *wq, struct proc *p, void *chan)
+{
+  struct proc **pp;
+
+  if(p->state != SLEEPING || p->chan != chan)
+    return 0;
+  for(pp = &wq->head; *pp; pp = &(*pp)->wqnext){
+    if(*pp == p){
+      *pp = p->wqnext;
+      p->wqnext = 0;
+      setrunnable(p);
+      return 1;
+    }
+  }
+  panic("unsleep");
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void
 wakeup(void *chan)
 {
-  struct proc *p;
-
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-    }
+  struct waitq *wq = chanq(chan);
+  struct proc *p, *next;
+  int scanned = 0, woken = 0;
+
+  acquire(&wq->lock);
+  for(p = wq->head; p; p = next){
+    next = p->wqnext;
+    scanned++;
+    if(p->chan != chan)
+      continue;
+    acquire(&p->lock);
+    woken += unsleep(wq, p, chan);
+    release(&p->lock);
   }
+  release(&wq->lock);
+
+  __sync_fetch_and_add(&wakestat.calls, 1);
+  __sync_fetch_and_add(&wakestat.scanned, scanned);
+  __sync_fetch_and_add(&wakestat.woken, woken);
 }
 
 // Kill the process with the given pid.
@@ -598,14 +744,23 @@ int
 kill(int pid)
 {
   struct proc *p;
+  struct waitq *wq;
+  void *chan;
 
   for(p = proc; p < &proc[NPROC]; p++){
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
       if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
+        // Wake process from sleep(). The wait queue lock
+        // comes before p->lock, so let go and check again.
+        chan = p->chan;
+        release(&p->lock);
+        wq = chanq(chan);
+        acquire(&wq->lock);
+        acquire(&p->lock);
+        unsleep(wq, p, chan);
+        release(&wq->lock);
       }
       release(&p->lock);
       return 0;
@@ -664,6 +819,14 @@ either_copyin(void *dst, int user_src, uint64 src, uint64 len)
   }
 }
 
+// Print wakeup() costs. For ^T on the console.
+void
+wakeupdump(void)
+{
+  printf("wakeup: %lu calls, %lu sleepers scanned, %lu woken\n",
+         wakestat.calls, wakestat.scanned, wakestat.woken);
+}
+
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
 // No lock to avoid wedging a stuck machine further.
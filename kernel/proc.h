@@ -79,6 +79,16 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A segment of an executable, mapped by exec() and
+// loaded from the file a page at a time by vmfault().
+struct seg {
+  uint64 va;                   // Start address, page-aligned
+  uint64 memsz;                // Bytes of memory
+  uint64 filesz;               // Bytes loaded from the file; the rest is zero
+  uint off;                    // File offset of va
+  int perm;                    // PTE_X and/or PTE_W
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -91,6 +101,13 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU whose run queue it joins
+
+  // the run queue's lock must be held when using this:
+  struct proc *rqnext;         // Next on run queue, if RUNNABLE
+
+  // the wait queue's lock must be held when using this:
+  struct proc *wqnext;         // Next sleeper in chan's wait queue
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
@@ -103,5 +120,8 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct inode *exe;           // Executable backing segs
+  struct seg segs[NSEG];       // Demand-paged segments of exe
+  int nseg;                    // Number of entries in segs
   char name[16];               // Process name (debugging)
 };
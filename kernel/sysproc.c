@@ -32,6 +32,8 @@ sys_wait(void)
 {
   uint64 p;
   argaddr(0, &p);
+  // wait() copies out the status while holding locks.
+  uvmprefault(p, sizeof(int));
   return wait(p);
 }
 
@@ -41,6 +41,7 @@ static struct disk {
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
+  int unkicked;    // requests queued since the last notify.
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
@@ -212,13 +213,32 @@ alloc3_desc(int *idx)
   return 0;
 }
 
+// tell the device about requests queued by virtio_disk_submit().
+// caller holds vdisk_lock.
+static void
+kick(void)
+{
+  if(disk.unkicked){
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+    disk.unkicked = 0;
+  }
+}
+
+// queue a read or write of b, but don't notify the device
+// yet, so that a batch of requests costs a single notify.
+// the request starts when virtio_disk_kick() or
+// virtio_disk_wait() is called, or when the queue fills up.
+// b->disk stays set until the request completes.
 void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_submit(struct buf *b, int write)
 {
   uint64 sector = b->blockno * (BSIZE / 512);
 
   acquire(&disk.vdisk_lock);
 
+  if(b->disk)
+    panic("virtio_disk_submit");
+
   // the spec's Section 5.2 says that legacy block operations use
   // three descriptors: one for type/reserved/sector, one for the
   // data, one for a 1-byte status result.
@@ -229,6 +249,8 @@ virtio_disk_rw(struct buf *b, int write)
     if(alloc3_desc(idx) == 0) {
       break;
     }
+    // start what's queued, so descriptors will come free.
+    kick();
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
@@ -278,19 +300,41 @@ virtio_disk_rw(struct buf *b, int write)
 
   __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  disk.unkicked++;
+
+  release(&disk.vdisk_lock);
+}
+
+// start all queued requests.
+void
+virtio_disk_kick(void)
+{
+  acquire(&disk.vdisk_lock);
+  kick();
+  release(&disk.vdisk_lock);
+}
 
+// wait for the request for b, if any, to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  if(b->disk)
+    kick();
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
-
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(b, write);
+  virtio_disk_wait(b);
+}
+
 void
 virtio_disk_intr()
 {
@@ -317,6 +361,8 @@ virtio_disk_intr()
       panic("virtio_disk_intr status");
 
     struct buf *b = disk.info[id].b;
+    disk.info[id].b = 0;
+    free_chain(id);
     b->disk = 0;   // disk is done with buf
     wakeup(b);
 
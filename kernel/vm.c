@@ -5,6 +5,10 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "file.h"
 
 /*
  * the kernel's page table.
@@ -172,7 +176,8 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never touched (and so were
+// never allocated, see vmfault()) are skipped.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
@@ -185,9 +190,9 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -303,34 +308,33 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, make the
+// child's page table share its physical memory.
+// Writable pages become read-only and copy-on-write
+// in both page tables; vmfault() copies such a page
+// when either process first writes it. Pages that
+// the parent never touched stay unmapped in both.
 // returns 0 on success, -1 on failure.
-// frees any allocated pages on failure.
+// drops any references taken on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
   for(i = 0; i < sz; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    krefinc((void*)pa);
   }
   return 0;
 
@@ -366,8 +370,15 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
     if(va0 >= MAXVA)
       return -1;
     pte = walk(pagetable, va0, 0);
-    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
-       (*pte & PTE_W) == 0)
+    if(pte == 0 || (*pte & PTE_V) == 0){
+      // not yet touched; allocate it.
+      if(vmfault(pagetable, va0, 1) == 0)
+        return -1;
+      pte = walk(pagetable, va0, 0);
+    }
+    if((*pte & PTE_U) == 0)
+      return -1;
+    if((*pte & PTE_W) == 0 && vmfault(pagetable, va0, 1) == 0)
       return -1;
     pa0 = PTE2PA(*pte);
     n = PGSIZE - (dstva - va0);
@@ -393,7 +404,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
@@ -420,7 +431,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
@@ -449,3 +460,108 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
     return -1;
   }
 }
+
+// Handle a fault on user virtual address va, for a user
+// access or for copyin()/copyout(). write is set for stores.
+// - A page below p->sz that was never touched is either
+//   part of one of the executable's segments, which is
+//   read from the file (see exec()), or a lazily allocated
+//   heap page (see growproc()), which starts out zeroed.
+// - A store to a copy-on-write page gets the process its
+//   own copy of the page, or the page itself if no other
+//   page table still refers to it.
+// Returns the physical address of the page, or 0 if the
+// fault is not one the kernel can fix up.
+// Reading the executable may sleep, so callers must not
+// hold a spinlock unless they have used uvmprefault().
+uint64
+vmfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return 0;
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    if(p == 0 || pagetable != p->pagetable || va >= p->sz)
+      return 0;
+    if((mem = kalloc()) == 0)
+      return 0;
+    memset(mem, 0, PGSIZE);
+    flags = PTE_W|PTE_R|PTE_U;
+    struct seg *s;
+    for(s = p->segs; s < &p->segs[p->nseg]; s++){
+      if(va < s->va || va >= s->va + s->memsz)
+        continue;
+      if(va < s->va + s->filesz){
+        uint n = s->va + s->filesz - va;
+        if(n > PGSIZE)
+          n = PGSIZE;
+        ilock(p->exe);
+        if(readi(p->exe, 0, (uint64)mem, s->off + (va - s->va), n) != n){
+          iunlock(p->exe);
+          kfree(mem);
+          return 0;
+        }
+        iunlock(p->exe);
+      }
+      flags = PTE_R|PTE_U|s->perm;
+      break;
+    }
+    if(mappages(pagetable, va, PGSIZE, (uint64)mem, flags) != 0){
+      kfree(mem);
+      return 0;
+    }
+    return (uint64)mem;
+  }
+  if((*pte & PTE_U) == 0)
+    return 0;
+  if(!write || (*pte & PTE_COW) == 0)
+    return 0;
+
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  if(krefcnt((void*)pa) == 1){
+    // no one else shares the page.
+    *pte = PA2PTE(pa) | flags;
+    return pa;
+  }
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return (uint64)mem;
+}
+
+// Load any not-yet-loaded pages of the current process's
+// executable segments that overlap [va, va+len).
+// Code that copies to or from user memory while holding
+// a spinlock (pipes, the console, wait()) calls this
+// first, since loading a page may sleep.
+void
+uvmprefault(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct seg *s;
+  uint64 a, start, end;
+
+  if(va + len < va)
+    len = -va;
+  for(s = p->segs; s < &p->segs[p->nseg]; s++){
+    start = va > s->va ? va : s->va;
+    end = va + len < s->va + s->memsz ? va + len : s->va + s->memsz;
+    if(start >= end)
+      continue;   // not in this segment
+    for(a = PGROUNDDOWN(start); a < end; a += PGSIZE){
+      if(walkaddr(p->pagetable, a) == 0)
+        vmfault(p->pagetable, a, 0);
+    }
+  }
+}
@@ -22,7 +22,7 @@
 
 int nbitmap = FSSIZE/BPB + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = LOGSIZE;  // -l nlog to change
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -40,6 +40,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void dxbuild(uint inum);
 void die(const char *);
 
 // convert to riscv byte order
@@ -77,13 +78,28 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if(argc >= 3 && strcmp(argv[1], "-l") == 0){
+    nlog = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-l nlog] fs.img files...\n");
+    exit(1);
+  }
+
+  // the kernel's log header (seq, checksum, count, block #s)
+  // must fit in a block, and a transaction must fit in the log.
+  if(nlog - 1 < MAXOPBLOCKS || 3*4 + (nlog - 1)*4 > BSIZE){
+    fprintf(stderr, "mkfs: bad log size %d\n", nlog);
     exit(1);
   }
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert(sizeof(struct dxroot) == BSIZE);
+  assert(sizeof(struct dxleaf) == BSIZE);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
@@ -101,6 +117,7 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.bsize = xint(BSIZE);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
          nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
@@ -169,6 +186,8 @@ main(int argc, char *argv[])
   din.size = xint(off);
   winode(rootino, &din);
 
+  dxbuild(rootino);
+
   balloc(freeblock);
 
   exit(0);
@@ -251,6 +270,58 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the disk block holding block fbn of din,
+// allocating it if it is the first block past the end.
+// mkfs's files are laid out contiguously, so the inode's
+// extents and the first extent block are plenty.
+uint
+fmap(struct dinode *din, uint fbn)
+{
+  struct extent x[NXEXTENT], *e, *last, *slot;
+  uint base, b;
+  int i, inx;
+
+  base = 0;
+  last = slot = 0;
+  inx = 0;
+  for(i = 0; i < NEXTENT + NXEXTENT; i++){
+    if(i == NEXTENT){
+      if(xint(din->xaddrs[0]) == 0)
+        break;
+      rsect(xint(din->xaddrs[0]), (char*)x);
+      inx = 1;
+    }
+    e = i < NEXTENT ? &din->ext[i] : &x[i - NEXTENT];
+    if(xint(e->len) == 0){
+      slot = e;
+      break;
+    }
+    if(fbn < base + xint(e->len))
+      return xint(e->start) + fbn - base;
+    base += xint(e->len);
+    last = e;
+  }
+  assert(fbn == base);
+
+  b = freeblock++;
+  if(last && xint(last->start) + xint(last->len) == b){
+    last->len = xint(xint(last->len) + 1);
+  } else {
+    if(slot == 0){
+      assert(xint(din->xaddrs[0]) == 0);
+      din->xaddrs[0] = xint(freeblock++);
+      bzero(x, sizeof(x));
+      inx = 1;
+      slot = &x[0];
+    }
+    slot->start = xint(b);
+    slot->len = xint(1);
+  }
+  if(inx)
+    wsect(xint(din->xaddrs[0]), (char*)x);
+  return b;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -258,31 +329,31 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
   off = xint(din.size);
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
+  if(xshort(din.type) == T_FILE && xint(din.ext[0].len) == 0){
+    if(off + n <= NINLINE){
+      bcopy(p, din.data + off, n);
+      din.size = xint(off + n);
+      winode(inum, &din);
+      return;
+    }
+    if(off > 0){
+      // too big to stay inline: move to block 0.
+      x = fmap(&din, 0);
+      bzero(buf, BSIZE);
+      bcopy(din.data, buf, off);
+      wsect(x, buf);
+      bzero(din.data, NINLINE);
+    }
+  }
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = fmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -301,3 +372,67 @@ die(const char *s)
   perror(s);
   exit(1);
 }
+
+// Must match the kernel's dxhash().
+uint
+dxhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261;
+  for(i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Give directory inum a hashed index of its entries,
+// all in one leaf. If they don't fit, the index overflows.
+void
+dxbuild(uint inum)
+{
+  struct dinode din;
+  struct dxroot r;
+  struct dxleaf l;
+  struct dirent de[BSIZE / sizeof(struct dirent)];
+  uint off, size, root, leaf, n, nfree;
+  int i;
+
+  rinode(inum, &din);
+  size = xint(din.size);
+  bzero(&r, sizeof(r));
+  bzero(&l, sizeof(l));
+  n = nfree = 0;
+  for(off = 0; off < size; off += BSIZE){
+    rsect(fmap(&din, off / BSIZE), (char*)de);
+    for(i = 0; i < BSIZE / sizeof(struct dirent); i++){
+      if(de[i].inum == 0){
+        if(nfree < NDXFREE)
+          r.free[nfree++] = xint(off + i * sizeof(struct dirent));
+        else
+          r.holes = xint(1);
+        continue;
+      }
+      if(n == NDXSLOT){
+        // the leaf is full; the kernel scans for the rest.
+        r.overflow = xint(1);
+        continue;
+      }
+      l.slot[n].hash = xint(dxhash(de[i].name));
+      l.slot[n].off = xint(off + i * sizeof(struct dirent));
+      n++;
+    }
+  }
+  l.n = xint(n);
+  r.nfree = xint(nfree);
+
+  root = freeblock++;
+  leaf = freeblock++;
+  r.leaf[0] = xint(leaf);
+  wsect(root, &r);
+  wsect(leaf, &l);
+  din.dindex = xint(root);
+  winode(inum, &din);
+}
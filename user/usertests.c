@@ -1996,6 +1996,51 @@ forktest(char *s)
   }
 }
 
+// fork() shares memory copy-on-write, so a process using
+// more than half of physical memory can still fork, and
+// the parent's and child's writes must stay private.
+void
+cowfork(char *s)
+{
+  enum { SZ = (PHYSTOP - KERNBASE) / 8 * 5 };
+  char *a;
+  int i, pid, xstatus;
+
+  a = sbrk(SZ);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, SZ);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i += PGSIZE)
+    *(int*)(a + i) = i;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < SZ; i += 64*PGSIZE){
+      if(*(int*)(a + i) != i){
+        printf("%s: child read wrong value\n", s);
+        exit(1);
+      }
+      *(int*)(a + i) = -1;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(i = 0; i < SZ; i += PGSIZE){
+    if(*(int*)(a + i) != i){
+      printf("%s: child's write leaked into parent\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-SZ);
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2120,6 +2165,58 @@ sbrkmuch(char *s)
   }
 }
 
+// sbrk() allocates lazily, so reserving far more than
+// physical memory works as long as few pages are touched,
+// including by fork() and by read() into untouched pages.
+void
+sbrklazy(char *s)
+{
+  enum { BIG=512*1024*1024 };
+  char *a, *oldbrk;
+  int fd, pid, xstatus;
+
+  oldbrk = sbrk(0);
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(BIG) failed\n", s);
+    exit(1);
+  }
+  a[0] = 1;
+  a[BIG-1] = 2;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(a[0] != 1 || a[BIG-1] != 2 || a[BIG/2] != 0)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong contents\n", s);
+    exit(1);
+  }
+
+  fd = open("README", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open README failed\n", s);
+    exit(1);
+  }
+  if(read(fd, a + BIG/2, 10) != 10){
+    printf("%s: read into untouched page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(sbrk(-(sbrk(0) - oldbrk)) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+}
+
 // can we read the kernel's memory?
 void
 kernmem(char *s)
@@ -2633,8 +2730,10 @@ struct test {
   {dirfile, "dirfile"},
   {iref, "iref"},
   {forktest, "forktest"},
+  {cowfork, "cowfork"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
+  {sbrklazy, "sbrklazy"},
   {kernmem, "kernmem"},
   {MAXVAplus, "MAXVAplus"},
   {sbrkfail, "sbrkfail"},
@@ -2699,6 +2798,258 @@ bigdir(char *s)
   }
 }
 
+// a directory big enough to split its hashed index, with
+// entries removed and re-added, must still be readable
+// entry by entry.
+void
+dirindex(char *s)
+{
+  enum { N = 1200 };
+  int i, fd, n;
+  char name[8];
+  struct dirent de;
+
+  if(mkdir("dx") != 0 || chdir("dx") != 0){
+    printf("%s: mkdir/chdir dx failed\n", s);
+    exit(1);
+  }
+  if((fd = open("f", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create f failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  name[0] = 'd';
+  name[4] = '\0';
+  for(i = 0; i < N; i++){
+    name[1] = '0' + i / 100;
+    name[2] = '0' + (i / 10) % 10;
+    name[3] = '0' + i % 10;
+    if(link("f", name) != 0){
+      printf("%s: link %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i += 2){
+    name[1] = '0' + i / 100;
+    name[2] = '0' + (i / 10) % 10;
+    name[3] = '0' + i % 10;
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    name[1] = '0' + i / 100;
+    name[2] = '0' + (i / 10) % 10;
+    name[3] = '0' + i % 10;
+    fd = open(name, O_RDONLY);
+    if((fd >= 0) != (i % 2 == 1)){
+      printf("%s: open %s got %d\n", s, name, fd);
+      exit(1);
+    }
+    if(fd >= 0)
+      close(fd);
+  }
+  fd = open(".", O_RDONLY);
+  n = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de))
+    if(de.inum != 0)
+      n++;
+  close(fd);
+  if(n != N/2 + 3){
+    printf("%s: dx has %d entries, not %d\n", s, n, N/2 + 3);
+    exit(1);
+  }
+
+  unlink("f");
+  for(i = 1; i < N; i += 2){
+    name[1] = '0' + i / 100;
+    name[2] = '0' + (i / 10) % 10;
+    name[3] = '0' + i % 10;
+    unlink(name);
+  }
+  if(chdir("..") != 0 || unlink("dx") != 0){
+    printf("%s: unlink dx failed\n", s);
+    exit(1);
+  }
+}
+
+// names looked up, created, removed and looked up again must
+// not be answered from stale directory entry cache entries.
+void
+dcache(char *s)
+{
+  int i, fd;
+
+  if(mkdir("dc") != 0){
+    printf("%s: mkdir dc failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3; i++){
+    if(open("dc/x/y", O_RDONLY) >= 0 || open("dc/x", O_RDONLY) >= 0){
+      printf("%s: open of missing file succeeded\n", s);
+      exit(1);
+    }
+    if(mkdir("dc/x") != 0 || (fd = open("dc/x/y", O_CREATE|O_RDWR)) < 0){
+      printf("%s: create dc/x/y failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if((fd = open("dc/x/y", O_RDONLY)) < 0){
+      printf("%s: open dc/x/y failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(unlink("dc/x/y") != 0 || unlink("dc/x") != 0){
+      printf("%s: unlink failed\n", s);
+      exit(1);
+    }
+  }
+  if(unlink("dc") != 0){
+    printf("%s: unlink dc failed\n", s);
+    exit(1);
+  }
+}
+
+// a small file is kept in its inode until it outgrows it.
+void
+inlinefile(char *s)
+{
+  int fd, i, n;
+  char buf[400], got[400];
+
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + i % 26;
+  unlink("inl");
+  // grow a byte at a time past the inline size, then a lot.
+  for(n = 0; n < 300; n += n < 80 ? 1 : 100){
+    if((fd = open("inl", O_CREATE|O_RDWR)) < 0){
+      printf("%s: open inl failed\n", s);
+      exit(1);
+    }
+    if(n > 0 && (read(fd, got, sizeof(got)) != n || memcmp(got, buf, n) != 0)){
+      printf("%s: inl wrong before %d bytes\n", s, n);
+      exit(1);
+    }
+    i = n < 80 ? 1 : 100;
+    if(write(fd, buf + n, i) != i){
+      printf("%s: write inl failed\n", s);
+      exit(1);
+    }
+    close(fd);
+  }
+
+  // truncate and write a small file again.
+  if((fd = open("inl", O_RDWR|O_TRUNC)) < 0 || write(fd, "xyz", 3) != 3){
+    printf("%s: truncate inl failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("inl", O_RDONLY);
+  if(read(fd, got, sizeof(got)) != 3 || memcmp(got, "xyz", 3) != 0){
+    printf("%s: inl wrong after truncate\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("inl");
+}
+
+// interleave one-block appends to two files, so that each
+// block lands in an extent of its own, through the inode's
+// extents into the extent blocks and past them.
+void
+fragfile(char *s)
+{
+  enum { N = NEXTENT + NXEXTENT + 4 };
+  char *names[2] = { "frag0", "frag1" };
+  int fd[2], i, j;
+
+  for(j = 0; j < 2; j++){
+    unlink(names[j]);
+    if((fd[j] = open(names[j], O_CREATE|O_WRONLY)) < 0){
+      printf("%s: create %s failed\n", s, names[j]);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    for(j = 0; j < 2; j++){
+      memset(buf, 'a' + j, BSIZE);
+      memmove(buf, &i, sizeof(i));
+      if(write(fd[j], buf, BSIZE) != BSIZE){
+        printf("%s: write %s block %d failed\n", s, names[j], i);
+        exit(1);
+      }
+      // closing a writable fd allocates the block now.
+      close(open(names[j], O_WRONLY));
+    }
+  }
+  for(j = 0; j < 2; j++)
+    close(fd[j]);
+
+  for(j = 0; j < 2; j++){
+    if((fd[j] = open(names[j], O_RDONLY)) < 0){
+      printf("%s: open %s failed\n", s, names[j]);
+      exit(1);
+    }
+    for(i = 0; i < N; i++){
+      if(read(fd[j], buf, BSIZE) != BSIZE || *(int*)buf != i ||
+         buf[sizeof(i)] != 'a' + j || buf[BSIZE-1] != 'a' + j){
+        printf("%s: %s block %d wrong\n", s, names[j], i);
+        exit(1);
+      }
+    }
+    if(read(fd[j], buf, 1) != 0){
+      printf("%s: %s too long\n", s, names[j]);
+      exit(1);
+    }
+    close(fd[j]);
+    if(unlink(names[j]) != 0){
+      printf("%s: unlink %s failed\n", s, names[j]);
+      exit(1);
+    }
+  }
+}
+
+// a running program's file can't be opened for writing,
+// and a file open for writing can't be run.
+void
+textbusy(char *s)
+{
+  int fd, pid, xstatus;
+  char *args[] = { "echo", 0 };
+
+  if(open("usertests", O_RDWR) >= 0 || open("usertests", O_WRONLY|O_TRUNC) >= 0){
+    printf("%s: opened running usertests for writing\n", s);
+    exit(1);
+  }
+  if((fd = open("usertests", O_RDONLY)) < 0){
+    printf("%s: open usertests for reading failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if((fd = open("echo", O_RDWR)) < 0){
+    printf("%s: open echo for writing failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fd);  // the parent's file is still open
+    exec("echo", args);
+    exit(2);
+  }
+  wait(&xstatus);
+  close(fd);
+  if(xstatus != 2){
+    printf("%s: exec'd echo while open for writing\n", s);
+    exit(1);
+  }
+}
+
 // concurrent writes to try to provoke deadlock in the virtio disk
 // driver.
 void
@@ -2852,7 +3203,6 @@ diskfull(char *s)
       break;
     }
     for(int i = 0; i < MAXFILE; i++){
-      char buf[BSIZE];
       if(write(fd, buf, BSIZE) != BSIZE){
         done = 1;
         close(fd);
@@ -2941,6 +3291,11 @@ outofinodes(char *s)
 
 struct test slowtests[] = {
   {bigdir, "bigdir"},
+  {dirindex, "dirindex"},
+  {dcache, "dcache"},
+  {inlinefile, "inlinefile"},
+  {fragfile, "fragfile"},
+  {textbusy, "textbusy"},
   {manywrites, "manywrites"},
   {badwrite, "badwrite" },
   {execout, "execout"},